@@ -0,0 +1,407 @@
+#pragma once
+
+#include <assert.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <atomic>
+#include <chrono>
+#include <climits>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+#include "LockFreeRingQueue.h"
+
+// Policies of BroadcastChan, selected by its second template parameter.
+struct BroadcastBlock {};  // the publisher waits for the slowest subscriber
+struct BroadcastLag {};    // the publisher never waits, a slow subscriber skips messages
+
+// Single-publisher broadcast channel over one ring, every subscriber
+// receives every message without copying it into a queue of its own.
+//
+// The publisher writes each message once into the slot of its position,
+// each subscriber keeps its own cursor, the position of the next message it
+// reads, and copies the message out of the shared slot.
+//
+// For the slot of position pos:
+//   sequence == pos * 2 + 1   the publisher is writing the message of pos
+//   sequence == pos * 2 + 2   the message of pos is published
+//
+// With BroadcastBlock the publisher does not overwrite a slot until every
+// subscriber has passed it, the minimum cursor is cached and the cursors are
+// only scanned when the cache says the ring is full.
+//
+// With BroadcastLag the publisher overwrites the oldest slot, a subscriber
+// copies the message and checks the sequence again like a seqlock, so T must
+// be trivially copyable. A subscriber which has been lapped jumps to the
+// oldest message still in the ring and is told how many messages it missed.
+//
+// Publish must be called from one thread at a time, each Subscriber from one
+// thread at a time. At most max_subscriber_num subscribers exist at the same
+// time, a subscriber only sees the messages published after it subscribed.
+template<typename T, typename Policy = BroadcastBlock, typename WaitStrategy = YieldWaitStrategy>
+class BroadcastChan {
+  struct SubscriberSlot;
+
+public:
+  static_assert(!std::is_same<Policy, BroadcastLag>::value || std::is_trivially_copyable<T>::value,
+                "BroadcastLag reads slots which may be overwritten, T must be trivially copyable");
+
+  class Subscriber;
+
+  BroadcastChan(size_t queue_size, size_t max_subscriber_num = 64) :
+    subscriber_slot_num(max_subscriber_num) {
+    assert(queue_size > 0 && max_subscriber_num > 0);
+
+    cap = RoundUpPowerOfTwo(queue_size);
+    mask = cap - 1;
+
+    ring_queue = new(std::nothrow) Storage[cap];
+    assert(ring_queue);
+    sequences = new(std::nothrow) std::atomic<uint64_t>[cap];
+    assert(sequences);
+    for (size_t i = 0; i < cap; i++)
+      sequences[i].store(0, std::memory_order_relaxed);
+
+    subscriber_slots = new(std::nothrow) SubscriberSlot[subscriber_slot_num];
+    assert(subscriber_slots);
+
+    tail_pos.store(0, std::memory_order_relaxed);
+    cached_min.store(0, std::memory_order_relaxed);
+    is_closed.store(false, std::memory_order_relaxed);
+  }
+
+  // all the subscribers must be gone
+  ~BroadcastChan() {
+    if (std::is_same<Policy, BroadcastBlock>::value) {
+      uint64_t tail = tail_pos.load(std::memory_order_relaxed);
+      for (uint64_t pos = tail > cap ? tail - cap : 0; pos != tail; pos++)
+        SlotValue(pos)->~T();
+    }
+
+    delete []ring_queue;
+    ring_queue = nullptr;
+    delete []sequences;
+    sequences = nullptr;
+    delete []subscriber_slots;
+    subscriber_slots = nullptr;
+  }
+
+  BroadcastChan(const BroadcastChan&) = delete;
+  BroadcastChan& operator=(const BroadcastChan&) = delete;
+
+
+  THREAD_SAFE size_t GetCap() const {
+    return cap;
+  }
+
+  // an empty Subscriber if there are max_subscriber_num subscribers already
+  THREAD_SAFE Subscriber Subscribe() {
+    for (size_t i = 0; i < subscriber_slot_num; i++) {
+      SubscriberSlot& slot = subscriber_slots[i];
+      if (slot.active.load(std::memory_order_relaxed)
+          || slot.active.exchange(true, std::memory_order_acquire))
+        continue;
+
+      // A publisher which scanned the cursors before our store may run up
+      // to cap positions ahead of the tail it saw, so start from the tail
+      // seen after the store, the slot of that position is not overwritten
+      // until the publisher scans again and finds us.
+      uint64_t pos = tail_pos.load(std::memory_order_seq_cst);
+      slot.pos.store(pos, std::memory_order_seq_cst);
+      pos = tail_pos.load(std::memory_order_seq_cst);
+      slot.pos.store(pos, std::memory_order_release);
+      return Subscriber(this, &slot, pos);
+    }
+    return Subscriber();
+  }
+
+  // Publish the value to every subscriber. With BroadcastBlock it waits
+  // until the slowest subscriber leaves a free slot, with BroadcastLag it
+  // never waits.
+  void Publish(const T& value) {
+    PublishUntil(value, std::chrono::steady_clock::time_point::max());
+  }
+
+  void Publish(T&& value) {
+    PublishUntil(std::move(value), std::chrono::steady_clock::time_point::max());
+  }
+
+  // false if the slowest subscriber has not read the message of one lap ago
+  bool TryPublish(const T& value) {
+    return Emplace(value);
+  }
+
+  bool TryPublish(T&& value) {
+    return Emplace(std::move(value));
+  }
+
+  // Timed variants, return false if the ring is still full when the timeout
+  // expires. value is not moved from on timeout.
+  template<typename Rep, typename Period>
+  bool PublishFor(const T& value, const std::chrono::duration<Rep, Period>& timeout) {
+    return PublishUntil(value, std::chrono::steady_clock::now() + timeout);
+  }
+
+  template<typename Rep, typename Period>
+  bool PublishFor(T&& value, const std::chrono::duration<Rep, Period>& timeout) {
+    return PublishUntil(std::move(value), std::chrono::steady_clock::now() + timeout);
+  }
+
+  bool PublishUntil(const T& value, std::chrono::steady_clock::time_point deadline) {
+    return WaitStrategy::Wait(read_event, [&]() { return Emplace(value); }, deadline);
+  }
+
+  bool PublishUntil(T&& value, std::chrono::steady_clock::time_point deadline) {
+    // Emplace() only moves from value when it succeeds
+    return WaitStrategy::Wait(read_event, [&]() { return Emplace(std::move(value)); }, deadline);
+  }
+
+  // The subscribers receive the messages published before Close(), then
+  // their Recv() returns false. Called by the publisher.
+  void Close() {
+    is_closed.store(true, std::memory_order_release);
+    publish_event.Notify(INT_MAX);
+  }
+
+  THREAD_SAFE bool IsClosed() const {
+    return is_closed.load(std::memory_order_acquire);
+  }
+
+
+  // The receiving side of one subscription, unsubscribes when destroyed.
+  class Subscriber {
+  public:
+    Subscriber() : chan(nullptr), slot(nullptr), pos(0), missed_num(0) {}
+
+    Subscriber(Subscriber&& other) :
+      chan(other.chan), slot(other.slot), pos(other.pos), missed_num(other.missed_num) {
+      other.chan = nullptr;
+      other.slot = nullptr;
+    }
+
+    Subscriber& operator=(Subscriber&& other) {
+      if (this != &other) {
+        Unsubscribe();
+        chan = other.chan;
+        slot = other.slot;
+        pos = other.pos;
+        missed_num = other.missed_num;
+        other.chan = nullptr;
+        other.slot = nullptr;
+      }
+      return *this;
+    }
+
+    ~Subscriber() {
+      Unsubscribe();
+    }
+
+    Subscriber(const Subscriber&) = delete;
+    Subscriber& operator=(const Subscriber&) = delete;
+
+    explicit operator bool() const {
+      return chan != nullptr;
+    }
+
+    // Copy the next message into *ret_value, false if it is not published
+    // yet. With BroadcastLag *missed is set to the number of messages
+    // skipped before this one because the publisher lapped us.
+    bool TryRecv(T* ret_value, uint64_t* missed = nullptr) {
+      assert(chan);
+      if (!chan->TryRecvImpl(Policy(), this, ret_value))
+        return false;
+      if (missed)
+        *missed = missed_num;
+      missed_num = 0;
+      return true;
+    }
+
+    // blocked, false only when the channel is closed and every message
+    // published before Close() is received
+    bool Recv(T* ret_value, uint64_t* missed = nullptr) {
+      return RecvUntil(ret_value, std::chrono::steady_clock::time_point::max(), missed);
+    }
+
+    template<typename Rep, typename Period>
+    bool RecvFor(T* ret_value, const std::chrono::duration<Rep, Period>& timeout,
+                 uint64_t* missed = nullptr) {
+      return RecvUntil(ret_value, std::chrono::steady_clock::now() + timeout, missed);
+    }
+
+    // false on timeout too
+    bool RecvUntil(T* ret_value, std::chrono::steady_clock::time_point deadline,
+                   uint64_t* missed = nullptr) {
+      assert(chan);
+      bool is_received = false;
+      WaitStrategy::Wait(chan->publish_event, [&]() {
+        is_received = TryRecv(ret_value, missed);
+        return is_received || IsDrained();
+      }, deadline);
+      return is_received;
+    }
+
+    void Unsubscribe() {
+      if (chan == nullptr)
+        return;
+      slot->pos.store(no_subscriber, std::memory_order_release);
+      slot->active.store(false, std::memory_order_release);
+      // the publisher may be waiting for us
+      if (WaitStrategy::need_notify)
+        chan->read_event.Notify(1);
+      chan = nullptr;
+      slot = nullptr;
+    }
+
+  private:
+    friend class BroadcastChan;
+
+    Subscriber(BroadcastChan* chan, SubscriberSlot* slot, uint64_t pos) :
+      chan(chan), slot(slot), pos(pos), missed_num(0) {}
+
+    // Close() is stored after the last tail_pos, so the tail seen after it
+    // is final
+    bool IsDrained() const {
+      return chan->is_closed.load(std::memory_order_acquire)
+        && pos >= chan->tail_pos.load(std::memory_order_acquire);
+    }
+
+    BroadcastChan* chan;
+    SubscriberSlot* slot;
+    uint64_t pos;           // the position of the next message to read
+    uint64_t missed_num;    // skipped since the last received message
+  };
+
+
+private:
+  typedef typename std::aligned_storage<sizeof(T), alignof(T)>::type Storage;
+
+  const static uint64_t no_subscriber = UINT64_MAX;
+
+  struct SubscriberSlot {
+    std::atomic<bool> active;       // owned by a subscriber
+    std::atomic<uint64_t> pos;      // the cursor of the owner, written by the owner
+    char pad[ring_queue_pad_size];
+
+    SubscriberSlot() : active(false), pos(no_subscriber) {}
+  };
+
+  T* SlotValue(uint64_t pos) {
+    return reinterpret_cast<T*>(&ring_queue[pos & mask]);
+  }
+
+  // the minimum cursor, tail if there is no subscriber
+  uint64_t ScanCursors(uint64_t tail) {
+    uint64_t min_pos = tail;
+    for (size_t i = 0; i < subscriber_slot_num; i++) {
+      uint64_t pos = subscriber_slots[i].pos.load(std::memory_order_acquire);
+      if (pos < min_pos)
+        min_pos = pos;
+    }
+    return min_pos;
+  }
+
+  bool IsFull(BroadcastBlock, uint64_t pos) {
+    if (pos - cached_min.load(std::memory_order_relaxed) < cap)
+      return false;
+    uint64_t min_pos = ScanCursors(pos);
+    cached_min.store(min_pos, std::memory_order_relaxed);
+    return pos - min_pos >= cap;
+  }
+
+  bool IsFull(BroadcastLag, uint64_t) {
+    return false;
+  }
+
+  template<typename... Args>
+  bool Emplace(Args&&... args) {
+    uint64_t pos = tail_pos.load(std::memory_order_relaxed);
+    if (IsFull(Policy(), pos))
+      return false;
+
+    std::atomic<uint64_t>& sequence = sequences[pos & mask];
+    if (std::is_same<Policy, BroadcastBlock>::value) {
+      // every subscriber has read the message of last lap
+      if (pos >= cap)
+        SlotValue(pos)->~T();
+      new (SlotValue(pos)) T(std::forward<Args>(args)...);
+    } else {
+      // odd sequence tells the readers the slot is being overwritten
+      sequence.store(pos * 2 + 1, std::memory_order_relaxed);
+      std::atomic_thread_fence(std::memory_order_release);
+      new (SlotValue(pos)) T(std::forward<Args>(args)...);
+    }
+    sequence.store(pos * 2 + 2, std::memory_order_release);
+    tail_pos.store(pos + 1, std::memory_order_release);
+
+    if (WaitStrategy::need_notify)
+      publish_event.Notify(INT_MAX);
+    return true;
+  }
+
+  bool TryRecvImpl(BroadcastBlock, Subscriber* sub, T* ret_value) {
+    uint64_t pos = sub->pos;
+    if (sequences[pos & mask].load(std::memory_order_acquire) != pos * 2 + 2)
+      return false;
+
+    *ret_value = *SlotValue(pos);
+    sub->pos = pos + 1;
+    // give the slot back to the publisher once every subscriber passed it
+    sub->slot->pos.store(pos + 1, std::memory_order_release);
+    if (WaitStrategy::need_notify)
+      read_event.Notify(1);
+    return true;
+  }
+
+  bool TryRecvImpl(BroadcastLag, Subscriber* sub, T* ret_value) {
+    while (true) {
+      uint64_t pos = sub->pos;
+      std::atomic<uint64_t>& sequence = sequences[pos & mask];
+      uint64_t seq = sequence.load(std::memory_order_acquire);
+      if (seq < pos * 2 + 2)
+        return false;
+
+      if (seq == pos * 2 + 2) {
+        Storage copy;
+        memcpy(&copy, SlotValue(pos), sizeof(T));
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (sequence.load(std::memory_order_relaxed) == seq) {
+          memcpy(ret_value, &copy, sizeof(T));
+          sub->pos = pos + 1;
+          sub->slot->pos.store(pos + 1, std::memory_order_relaxed);
+          return true;
+        }
+      }
+
+      // lapped, jump to the oldest message of the ring, if the publisher is
+      // still overwriting our slot try again later
+      uint64_t tail = tail_pos.load(std::memory_order_acquire);
+      uint64_t oldest = tail > cap ? tail - cap : 0;
+      if (oldest <= pos)
+        return false;
+      sub->missed_num += oldest - pos;
+      sub->pos = oldest;
+      sub->slot->pos.store(oldest, std::memory_order_relaxed);
+    }
+  }
+
+  size_t cap;
+  size_t mask;
+  Storage* ring_queue;
+  std::atomic<uint64_t>* sequences;
+  const size_t subscriber_slot_num;
+  SubscriberSlot* subscriber_slots;
+  char pad0[ring_queue_pad_size];
+
+  // publisher side
+  std::atomic<uint64_t> tail_pos;     // the position of the next message
+  std::atomic<uint64_t> cached_min;   // the minimum cursor of the last scan
+  std::atomic<bool> is_closed;
+  char pad1[ring_queue_pad_size];
+
+  RingQueueEvent publish_event;       // a message is published or the channel is closed
+  char pad2[ring_queue_pad_size];
+  RingQueueEvent read_event;          // a subscriber has moved its cursor or gone
+  char pad3[ring_queue_pad_size];
+};
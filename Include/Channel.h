@@ -3,56 +3,103 @@
 
 #pragma once
 
+#include <assert.h>
 #include <chrono>
 #include <stddef.h>
+#include <stdint.h>
 #include <thread>
 #include <vector>
 #include <functional>
 #include <random>
 #include <algorithm>
+#include <iterator>
 #include <memory>
+#include <tuple>
+#include <type_traits>
+#include <utility>
 #include <mutex>
 #include <atomic>
 #include <condition_variable>
 #include <iostream>
-// debug
-#include <chrono>
 
-//#define ZBASELIB_DEBUG
+#include "TimerWheel.h"
+#include "Trace.h"
+
+// define ZBASELIB_DEBUG or ZBASELIB_TRACE_CHANNEL to trace the channel
+// operations into the trace ring, see Trace.h
 
 
 namespace zbaselib {
 
+class CoroutineHook;
+inline void SetCoroutineHook(CoroutineHook* hook);
+
+// buffer_size of a channel whose capacity is given at construction, e.g.
+//   Chan<int> ch(config.queue_size);
+// all capacities share one instantiation, and a Chan<int> of any capacity
+// can be passed as IChan<int>/OChan<int>
+const static size_t dynamic_buffer_size = static_cast<size_t>(-1);
+
+// Lets a coroutine library run blocking channel operations in its
+// coroutines, a blocked operation suspends the coroutine instead of the
+// thread. The library installs its hook with SetCoroutineHook() on the
+// threads which run its coroutines, see zco/co_channel.hpp.
+//
+// A coroutine whose stack is copied in and out of a shared stack can not
+// let other threads point into its stack, so a blocked coroutine keeps its
+// waiter on the heap. Timed operations still block the thread.
+class CoroutineHook {
+public:
+  virtual ~CoroutineHook() {}
+
+  // the running coroutine, nullptr if the thread is not in a coroutine
+  virtual void* Current() = 0;
+
+  // suspend the running coroutine until Resume() is called, it may also
+  // return spuriously
+  virtual void Suspend() = 0;
+
+  // make the coroutine runnable again, called from any thread
+  virtual void Resume(void* coroutine) = 0;
+};
+
 namespace internal {
 template<typename...> constexpr bool dependent_false = false;
 
+// Bounded MPMC circular buffer. Like LockFreeRingQueue every slot carries
+// its own sequence number, so a Push/Pop never waits for the others to
+// finish their copy. The capacity is exact. When buffer_size is a compile time
+// constant pos % buffer_size is cheap, with dynamic_buffer_size the capacity
+// is given to the constructor instead.
+//
+// The sequence of the slot of position pos is pos * 2 when the slot is free
+// for pos and pos * 2 + 1 when it is filled, so a filled slot never looks
+// free for pos + 1 even if the capacity is 1.
 template<typename T, size_t buffer_size>
 class LockFreeCircularBuffer {
 public:
-  LockFreeCircularBuffer() :
-    cap(buffer_size),
-    circular_buffer(new(std::nothrow) T[buffer_size]) {
+  explicit LockFreeCircularBuffer(size_t capacity = buffer_size) :
+    cap(capacity),
+    circular_buffer(new(std::nothrow) T[capacity]),
+    sequences(new(std::nothrow) std::atomic<uint64_t>[capacity]),
+    head_pos(0),
+    tail_pos(0) {
     static_assert(buffer_size > 0, "buffer_size must > 0");
+    assert(capacity > 0 && capacity != dynamic_buffer_size);
+    assert(buffer_size == dynamic_buffer_size || capacity == buffer_size);
+
+    for (size_t i = 0; i < cap; i++)
+      sequences[i].store(i * 2, std::memory_order_relaxed);
     
-#ifdef ZBASELIB_DEBUG
-    std::cout << "thread_id:" << std::this_thread::get_id() << " LockFreeCircularBuffer" << std::endl;
-    std::thread([&]() {
-      while (true) {
-	bool is_empty = IsEmpty();
-	bool is_full = IsFull();
-	std::cout << "thread_id:" << std::this_thread::get_id() <<  " IsFull:" << is_full << " IsEmpty:" << is_empty << std::endl;
-	std::this_thread::sleep_for(std::chrono::milliseconds(2000));
-      }
-    }).detach();
-#endif // ZBASELIB_DEBUG
+    ZBASELIB_TRACE(CHANNEL, ZBASELIB_TRACE_INFO, "LockFreeCircularBuffer cap:%zu", cap);
   }
 
   ~LockFreeCircularBuffer() {
-#ifdef ZBASELIB_DEBUG
-    std::cout << "thread_id:" << std::this_thread::get_id() << " ~LockFreeCircularBuffer" << std::endl;
-#endif // ZBASELIB_DEBUG
+    ZBASELIB_TRACE(CHANNEL, ZBASELIB_TRACE_INFO, "~LockFreeCircularBuffer");
     delete [] circular_buffer;
     circular_buffer = nullptr;
+    delete [] sequences;
+    sequences = nullptr;
     cap = 0;
   }
 
@@ -64,297 +111,1265 @@ public:
   }
 
   bool IsEmpty() const {
-    uint64_t pos = 0;
-    BufferPos* pos_ptr = (BufferPos*)&pos;
-    pos = buffer_pos.load(std::memory_order_relaxed);
-    return static_cast<bool>(pos_ptr->is_empty);
+    uint64_t tail = tail_pos.load(std::memory_order_relaxed);
+    return head_pos.load(std::memory_order_relaxed) >= tail;
   }
 
   bool IsFull() const {
-    uint64_t pos = 0;
-    BufferPos* pos_ptr = (BufferPos*)&pos;
-    pos = buffer_pos.load(std::memory_order_relaxed);
-    return static_cast<bool>(pos_ptr->is_full);
+    uint64_t head = head_pos.load(std::memory_order_relaxed);
+    return tail_pos.load(std::memory_order_relaxed) - head >= Cap();
   }
 
   bool Push(T value) {
-    std::cout << "Push: " << value << std::endl;
+    ZBASELIB_TRACE(CHANNEL, ZBASELIB_TRACE_VERBOSE, "Push");
+    uint64_t pos = tail_pos.load(std::memory_order_relaxed);
     while (true) {
-      uint64_t old_pos = 0;
-      uint64_t new_pos = 0;
-      BufferPos* old_pos_ptr = (BufferPos*)&old_pos;
-      BufferPos* new_pos_ptr = (BufferPos*)&new_pos;
-
-      old_pos = buffer_pos.load(std::memory_order_relaxed);
-      new_pos = old_pos;
-      
-      // buffer is full, so insert failed
-      if (old_pos_ptr->is_full)
+      uint64_t seq = sequences[Index(pos)].load(std::memory_order_acquire);
+      int64_t diff = (int64_t)seq - (int64_t)(pos * 2);
+
+      if (diff == 0) {
+	// the slot is free, try to claim position pos
+	if (tail_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+	  break;
+      } else if (diff < 0) {
+	// buffer is full, so insert failed
 	return false;
-      // the buffer is locked by other thread, try again
-      if (old_pos_ptr->is_locked)
-	continue;
-
-      ++new_pos_ptr->tail_pos;
-      // lock the buffer
-      new_pos_ptr->is_locked = 1;
-      new_pos_ptr->is_empty = 0;
-      // adjust the tail pos, if the tail pointer point to the buffer's end, change it to the buffer's begin
-      if (new_pos_ptr->tail_pos >= cap)
-	new_pos_ptr->tail_pos -= cap;
-      // change if the buffer is full
-      if (new_pos_ptr->tail_pos == new_pos_ptr->head_pos)
-	new_pos_ptr->is_full = 1;
-
-      bool is_buffer_pos_not_changed = buffer_pos.compare_exchange_weak(old_pos, new_pos, std::memory_order_seq_cst);
-      if (is_buffer_pos_not_changed) {
-	circular_buffer[old_pos_ptr->tail_pos] = value;
-	while (true) {
-	  old_pos = buffer_pos.load(std::memory_order_relaxed);
-	  new_pos = old_pos;
-	  // free buffer lock
-	  new_pos_ptr->is_locked = 0;
-
-	  bool is_free_lock_succeed = buffer_pos.compare_exchange_weak(old_pos, new_pos, std::memory_order_seq_cst);
-	  if (is_free_lock_succeed)
-	    break;
-	}
-	break;
+      } else {
+	// other thread has claimed pos, try again
+	pos = tail_pos.load(std::memory_order_relaxed);
       }
     }
+
+    circular_buffer[Index(pos)] = std::move(value);
+    sequences[Index(pos)].store(pos * 2 + 1, std::memory_order_release);
     return true;
   }
 
   bool Pop(T* ret_value) {
-    std::cout << "Pop" << std::endl;
+    ZBASELIB_TRACE(CHANNEL, ZBASELIB_TRACE_VERBOSE, "Pop");
+    uint64_t pos = head_pos.load(std::memory_order_relaxed);
     while (true) {
-      uint64_t old_pos = 0;
-      uint64_t new_pos = 0;
-      BufferPos* old_pos_ptr = (BufferPos*)&old_pos;
-      BufferPos* new_pos_ptr = (BufferPos*)&new_pos;
-
-      old_pos = buffer_pos.load(std::memory_order_relaxed);
-      new_pos = old_pos;
-
-      // buffer is empty
-      if (old_pos_ptr->is_empty)
+      uint64_t seq = sequences[Index(pos)].load(std::memory_order_acquire);
+      int64_t diff = (int64_t)seq - (int64_t)(pos * 2 + 1);
+
+      if (diff == 0) {
+	// the slot is filled, try to claim position pos
+	if (head_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+	  break;
+      } else if (diff < 0) {
+	// buffer is empty
 	return false;
+      } else {
+	// other thread has claimed pos, try again
+	pos = head_pos.load(std::memory_order_relaxed);
+      }
+    }
 
-      if (old_pos_ptr->is_locked)
-	continue;
-
-      ++new_pos_ptr->head_pos;
-      // adjust head pointer's position
-      if (new_pos_ptr->head_pos >= cap)
-	new_pos_ptr->head_pos -= cap;
+    *ret_value = std::move(circular_buffer[Index(pos)]);
+    sequences[Index(pos)].store((pos + Cap()) * 2, std::memory_order_release);
+    return true;
+  }
 
-      new_pos_ptr->is_full = 0;
+  // Push up to n values from first with one CAS, first is advanced past the
+  // pushed values. Returns how many are pushed, 0 when full.
+  template<typename InputIt>
+  size_t PushN(InputIt& first, size_t n) {
+    ZBASELIB_TRACE(CHANNEL, ZBASELIB_TRACE_VERBOSE, "PushN %zu", n);
+    uint64_t pos = tail_pos.load(std::memory_order_relaxed);
+    size_t count = 0;
+    while (true) {
+      uint64_t head = head_pos.load(std::memory_order_acquire);
+      int64_t used = (int64_t)(pos - head);
+      if (used < 0) {
+        // pos is stale
+        pos = tail_pos.load(std::memory_order_relaxed);
+        continue;
+      }
+      count = std::min<size_t>(n, Cap() - std::min<size_t>(used, Cap()));
+      if (count == 0)
+        return 0;
+      if (tail_pos.compare_exchange_weak(pos, pos + count, std::memory_order_relaxed))
+        break;
+    }
 
-      if (new_pos_ptr->head_pos == new_pos_ptr->tail_pos)
-	new_pos_ptr->is_empty = 1;
+    for (size_t i = 0; i < count; i++, ++first) {
+      // the reader which claimed this slot a round ago may still be copying
+      WaitSequence(pos + i, (pos + i) * 2);
+      circular_buffer[Index(pos + i)] = *first;
+      sequences[Index(pos + i)].store((pos + i) * 2 + 1, std::memory_order_release);
+    }
+    return count;
+  }
 
-      *ret_value = circular_buffer[old_pos_ptr->head_pos];
+  // Pop up to n values into out with one CAS, out is advanced past the
+  // popped values. Returns how many are popped, 0 when empty.
+  template<typename OutputIt>
+  size_t PopN(OutputIt& out, size_t n) {
+    ZBASELIB_TRACE(CHANNEL, ZBASELIB_TRACE_VERBOSE, "PopN %zu", n);
+    uint64_t pos = head_pos.load(std::memory_order_relaxed);
+    size_t count = 0;
+    while (true) {
+      uint64_t tail = tail_pos.load(std::memory_order_acquire);
+      int64_t used = (int64_t)(tail - pos);
+      if (used <= 0)
+        return 0;
+      count = std::min<size_t>(n, used);
+      if (count == 0)
+        return 0;
+      if (head_pos.compare_exchange_weak(pos, pos + count, std::memory_order_relaxed))
+        break;
+    }
 
-      bool is_pop_succeed = buffer_pos.compare_exchange_weak(old_pos, new_pos, std::memory_order_seq_cst);
-      if (is_pop_succeed)
-	break;
+    for (size_t i = 0; i < count; i++, ++out) {
+      // the writer which claimed this slot may still be copying
+      WaitSequence(pos + i, (pos + i) * 2 + 1);
+      *out = std::move(circular_buffer[Index(pos + i)]);
+      sequences[Index(pos + i)].store((pos + i + Cap()) * 2, std::memory_order_release);
     }
-    return true;
+    return count;
   }
   
 private:
+  // folds to the constant unless the capacity is dynamic
+  size_t Cap() const {
+    return buffer_size == dynamic_buffer_size ? cap : buffer_size;
+  }
+
+  size_t Index(uint64_t pos) const {
+    return static_cast<size_t>(pos % Cap());
+  }
+
+  // the slot of pos is claimed by us, wait for the thread which had it
+  // before to finish its copy, which is short
+  void WaitSequence(uint64_t pos, uint64_t seq) {
+    for (int spin = 0; sequences[Index(pos)].load(std::memory_order_acquire) != seq; spin++) {
+      if (spin >= 64)
+        std::this_thread::yield();
+    }
+  }
+
   size_t cap;
   T* circular_buffer;
-  std::atomic_uint64_t buffer_pos;
-
-#pragma pack(8)
-  struct BufferPos {
-    volatile uint64_t head_pos  : 20;
-    volatile uint64_t tail_pos  : 20;
-    volatile uint64_t is_locked :  1;
-    volatile uint64_t is_empty  :  1;
-    volatile uint64_t is_full   :  1;
-    volatile uint64_t useless   : 21;
-  };
-#pragma pack()
+  std::atomic<uint64_t>* sequences;  // sequence number of each slot
+  std::atomic<uint64_t> head_pos;    // next position to pop, only increase
+  std::atomic<uint64_t> tail_pos;    // next position to push, only increase
+};
+
+
+// the running coroutine of a thread, see CoroutineHook
+struct CoroutineRef {
+  CoroutineHook* hook = nullptr;
+  void* coroutine = nullptr;
+};
+
+inline CoroutineHook*& ThreadCoroutineHook() {
+  static thread_local CoroutineHook* hook = nullptr;
+  return hook;
+}
+
+inline CoroutineRef CurrentCoroutine() {
+  CoroutineRef co;
+  co.hook = ThreadCoroutineHook();
+  if (co.hook)
+    co.coroutine = co.hook->Current();
+  return co;
+}
+
+
+struct SelectNode;
+
+// A blocked Select. It is watching several channels at once, every channel
+// holds one SelectNode of it, and whichever channel becomes ready first
+// wakes it up. A coroutine is suspended instead of its thread.
+//
+// While it is parked (between Open() and Close()) the other end of an
+// unbuffered channel may Claim() one of its nodes and finish that case for
+// it. Only one node can be claimed, and none while the Select tries its
+// cases itself.
+class SelectWaiter {
+public:
+  explicit SelectWaiter(CoroutineRef co = CoroutineRef()) :
+    co(co), is_ready(false), is_open(false), fired(nullptr) {}
+
+  SelectWaiter(const SelectWaiter&) = delete;
+  SelectWaiter& operator=(const SelectWaiter&) = delete;
+
+  void Reset() {
+    std::lock_guard<std::mutex> ulock(lock);
+    is_ready = false;
+  }
+
+  void Wake() {
+    std::lock_guard<std::mutex> ulock(lock);
+    is_ready = true;
+    if (co.coroutine)
+      co.hook->Resume(co.coroutine);
+    else
+      cond.notify_one();
+  }
+
+  void Park() {
+    std::unique_lock<std::mutex> ulock(lock);
+    while (!is_ready) {
+      if (co.coroutine) {
+        // Suspend() may return before Wake()
+        ulock.unlock();
+        co.hook->Suspend();
+        ulock.lock();
+      } else {
+        cond.wait(ulock);
+      }
+    }
+  }
+
+  void Open() {
+    std::lock_guard<std::mutex> ulock(lock);
+    is_open = true;
+  }
+
+  // returns the claimed node, nullptr if none
+  SelectNode* Close() {
+    std::lock_guard<std::mutex> ulock(lock);
+    is_open = false;
+    return fired;
+  }
+
+  // must be called with the buffer_lock of the channel of node held, the
+  // claimer moves the value and then calls Wake()
+  bool Claim(SelectNode* node) {
+    std::lock_guard<std::mutex> ulock(lock);
+    if (!is_open)
+      return false;
+    is_open = false;
+    fired = node;
+    return true;
+  }
+
+private:
+  CoroutineRef co;
+  std::mutex lock;
+  std::condition_variable cond;
+  bool is_ready;
+  bool is_open;       // a parked Select, its nodes can be claimed
+  SelectNode* fired;  // the claimed node
 };
 
+// the link of a SelectWaiter in the select list of one channel
+struct SelectNode {
+  SelectWaiter* waiter = nullptr;
+  // the value to send, or where to receive, when the other end of an
+  // unbuffered channel may claim the node. nullptr for other channels.
+  void* value = nullptr;
+  SelectNode* prev = nullptr;
+  SelectNode* next = nullptr;
+};
+
+// intrusive list of SelectNode, guarded by the buffer_lock of the channel
+struct SelectList {
+  SelectNode* head = nullptr;
+
+  void Add(SelectNode* node) {
+    node->prev = nullptr;
+    node->next = head;
+    if (head)
+      head->prev = node;
+    head = node;
+  }
+
+  void Remove(SelectNode* node) {
+    if (node->prev)
+      node->prev->next = node->next;
+    else
+      head = node->next;
+    if (node->next)
+      node->next->prev = node->prev;
+    node->prev = node->next = nullptr;
+  }
+
+  // a woken select retries all its cases and may take the value of
+  // another channel, so a value can not be handed to one select only.
+  // Close() relies on waking every select, each one sees the channel closed.
+  void WakeAll(const SelectWaiter* except = nullptr) {
+    for (SelectNode* node = head; node; node = node->next) {
+      if (node->waiter != except)
+        node->waiter->Wake();
+    }
+  }
+
+  // take a parked Select which offers a value, see SelectWaiter
+  SelectNode* Claim() {
+    for (SelectNode* node = head; node; node = node->next) {
+      if (node->value && node->waiter->Claim(node))
+        return node;
+    }
+    return nullptr;
+  }
+};
+
+// Block the running coroutine until try_func() returns true. The coroutine
+// watches the channel like a Select of one case, its waiter is on the heap.
+template<typename Buffer, typename TryFunc>
+void CoroutineWait(Buffer* buffer, bool is_read, const CoroutineRef& co, TryFunc try_func) {
+  std::unique_ptr<SelectWaiter> waiter(new SelectWaiter(co));
+  std::unique_ptr<SelectNode> node(new SelectNode);
+  node->waiter = waiter.get();
+  while (!try_func()) {
+    waiter->Reset();
+    if (is_read)
+      buffer->AddReadSelect(node.get());
+    else
+      buffer->AddWriteSelect(node.get());
+
+    bool done = try_func();
+    if (!done)
+      waiter->Park();
+
+    if (is_read)
+      buffer->RemoveReadSelect(node.get());
+    else
+      buffer->RemoveWriteSelect(node.get());
+    if (done)
+      return;
+  }
+}
+
   
+// Send and receive on a non-full/non-empty buffer only touch the lock-free
+// buffer. buffer_lock and the condition variables are only used when a
+// thread has to block, and the waiting counters let the other side skip the
+// notify when nobody waits. A blocked Select counts as a waiter too.
 template<typename T, size_t buffer_size = 1>
 class ChannelBuffer {
 public:
-  ChannelBuffer() : is_closed(false) {}
+  explicit ChannelBuffer(size_t capacity = buffer_size) :
+    buffer(capacity), is_closed(false), reader_waiting(0), writer_waiting(0) {}
 
   ~ChannelBuffer() = default;
 
-  // blocked
+  // blocked, T{} when the channel is closed and drained
   T GetNextValue() {
-    std::cout << "GetNextValue" << std::endl;
-    std::unique_lock<std::mutex> ulock(buffer_lock);
-    // must return a vaild value or wait forever
-    while (true) {
-      std::cout << "GetNextValue while" << std::endl;
-      if (is_closed)
-	      return {};
+    T value;
+    if (!GetNextValue(&value))
+      return {};
+    return value;
+  }
 
-      if (buffer.IsEmpty()) {
-	      writer_waiter.notify_one();
-	      reader_waiter.wait(ulock, [&]() { return !buffer.IsEmpty() || is_closed; });
-      }
+  // blocked, the values inserted before Close() are still received, false
+  // only when the channel is closed and drained
+  bool GetNextValue(T* value) {
+    ZBASELIB_TRACE(CHANNEL, ZBASELIB_TRACE_VERBOSE, "GetNextValue");
+    if (buffer.Pop(value)) {
+      NotifyWriter();
+      return true;
+    }
+
+    // a closed channel is drained without locking, the last Pop covers
+    // the values inserted just before Close()
+    if (is_closed) {
+      if (!buffer.Pop(value))
+        return false;
+      NotifyWriter();
+      return true;
+    }
 
-      if (is_closed)
-	      return {};
+    CoroutineRef co = CurrentCoroutine();
+    if (co.coroutine) {
+      bool ok = false;
+      CoroutineWait(this, true, co, [&]() { return TryGetNextValue(value, &ok); });
+      return ok;
+    }
 
-      T value;
-      bool get_value_succeed = buffer.Pop(&value);
-      if (!get_value_succeed)
-	continue;
-      writer_waiter.notify_one();
-      return value;  
+    {
+      std::unique_lock<std::mutex> ulock(buffer_lock);
+      // pairs with the fence in NotifyReader(), either we see the new value,
+      // or the writer sees us waiting
+      reader_waiting.fetch_add(1);
+      std::atomic_thread_fence(std::memory_order_seq_cst);
+      while (!buffer.Pop(value)) {
+	ZBASELIB_TRACE(CHANNEL, ZBASELIB_TRACE_VERBOSE, "GetNextValue while");
+	if (is_closed) {
+	  reader_waiting.fetch_sub(1);
+	  return false;
+	}
+	reader_waiter.wait(ulock);
+      }
+      reader_waiting.fetch_sub(1);
     }
+    NotifyWriter();
+    return true;
   }
 
   // nonblocked
   std::unique_ptr<T> TryGetNextValue() {
-    if (is_closed)
-      return std::make_unique<T>(T{});
-
-    std::unique_lock<std::mutex> ulock(buffer_lock);
-    if (buffer.IsEmpty() && !is_closed) {
-      writer_waiter.notify_one();
+    T value;
+    if (!TryGetNextValue(&value))
       return nullptr;
+    return std::make_unique<T>(std::move(value));
+  }
+
+  // nonblocked, no allocation. Return true when a value is received or the
+  // channel is closed and drained, ok tells which one, and the value is T{}
+  // in the latter case.
+  bool TryGetNextValue(T* value, bool* ok = nullptr) {
+    if (!buffer.Pop(value)) {
+      if (!is_closed)
+        return false;
+      // the values inserted just before Close()
+      if (!buffer.Pop(value)) {
+        *value = T{};
+        if (ok)
+          *ok = false;
+        return true;
+      }
     }
 
-    T value;
-    bool get_value_succeed = buffer.Pop(&value);
-    if (get_value_succeed) {
-      writer_waiter.notify_one();
-      return std::move(std::make_unique<T>(value));
-    } else
-      return std::make_unique<T>(T{});
+    NotifyWriter();
+    if (ok)
+      *ok = true;
+    return true;
   }
 
   // blocked
   void InsertValue(T value) {
-    std::cout << "InsertValue: " << value << std::endl;
-    std::unique_lock<std::mutex> ulock(buffer_lock);
-    // must insert the value or wait forever
-    while (true) {
-      std::cout << "InsertValue while" << std::endl;
-      if (is_closed)
-	      return;
-      
-      if (buffer.IsFull()) {
-	      reader_waiter.notify_one();
-	      writer_waiter.wait(ulock, [&]() { return !buffer.IsFull() || is_closed; });
+    ZBASELIB_TRACE(CHANNEL, ZBASELIB_TRACE_VERBOSE, "InsertValue");
+    if (is_closed)
+      return;
+
+    if (buffer.Push(value)) {
+      NotifyReader();
+      return;
+    }
+
+    CoroutineRef co = CurrentCoroutine();
+    if (co.coroutine) {
+      CoroutineWait(this, false, co, [&]() { return is_closed || TryInsertValue(value); });
+      return;
+    }
+
+    {
+      std::unique_lock<std::mutex> ulock(buffer_lock);
+      // pairs with the fence in NotifyWriter()
+      writer_waiting.fetch_add(1);
+      std::atomic_thread_fence(std::memory_order_seq_cst);
+      // must insert the value or wait forever
+      while (!buffer.Push(value)) {
+	ZBASELIB_TRACE(CHANNEL, ZBASELIB_TRACE_VERBOSE, "InsertValue while");
+	if (is_closed) {
+	  writer_waiting.fetch_sub(1);
+	  return;
+	}
+	writer_waiter.wait(ulock);
       }
+      writer_waiting.fetch_sub(1);
+    }
+    NotifyReader();
+  }
 
-      if (is_closed)
-        return;
+  // blocked until deadline, false if timeout or the channel is closed and
+  // empty
+  template<typename Clock, typename Duration>
+  bool GetNextValueUntil(T* value, const std::chrono::time_point<Clock, Duration>& deadline) {
+    ZBASELIB_TRACE(CHANNEL, ZBASELIB_TRACE_VERBOSE, "GetNextValueUntil");
+    if (buffer.Pop(value)) {
+      NotifyWriter();
+      return true;
+    }
 
-      bool insert_value_succeed = buffer.Push(value);
-      if (!insert_value_succeed)
-	      continue;
-      reader_waiter.notify_one();
+    {
+      std::unique_lock<std::mutex> ulock(buffer_lock);
+      reader_waiting.fetch_add(1);
+      std::atomic_thread_fence(std::memory_order_seq_cst);
+      bool is_timeout = false;
+      while (!buffer.Pop(value)) {
+        if (is_closed || is_timeout) {
+          reader_waiting.fetch_sub(1);
+          return false;
+        }
+        is_timeout = reader_waiter.wait_until(ulock, deadline) == std::cv_status::timeout;
+      }
+      reader_waiting.fetch_sub(1);
+    }
+    NotifyWriter();
+    return true;
+  }
+
+  // blocked until deadline, false if timeout or the channel is closed
+  template<typename Clock, typename Duration>
+  bool InsertValueUntil(T value, const std::chrono::time_point<Clock, Duration>& deadline) {
+    ZBASELIB_TRACE(CHANNEL, ZBASELIB_TRACE_VERBOSE, "InsertValueUntil");
+    if (is_closed)
+      return false;
+
+    if (buffer.Push(value)) {
+      NotifyReader();
+      return true;
     }
+
+    {
+      std::unique_lock<std::mutex> ulock(buffer_lock);
+      writer_waiting.fetch_add(1);
+      std::atomic_thread_fence(std::memory_order_seq_cst);
+      bool is_timeout = false;
+      while (!buffer.Push(value)) {
+        if (is_closed || is_timeout) {
+          writer_waiting.fetch_sub(1);
+          return false;
+        }
+        is_timeout = writer_waiter.wait_until(ulock, deadline) == std::cv_status::timeout;
+      }
+      writer_waiting.fetch_sub(1);
+    }
+    NotifyReader();
+    return true;
   }
 
   // nonblocked
   bool TryInsertValue(T value) {
-    std::cout << "TryInsert: " << value << std::endl;
+    ZBASELIB_TRACE(CHANNEL, ZBASELIB_TRACE_VERBOSE, "TryInsert");
     if (is_closed)
       return false;
 
-    if (buffer.IsFull() && !is_closed) {
-      reader_waiter.notify_one();
+    if (!buffer.Push(value))
       return false;
+
+    NotifyReader();
+    return true;
+  }
+
+  // blocked, insert [first, last) as a few batches, every batch takes one
+  // CAS and one wakeup. Returns how many are inserted, less than the
+  // number of values only if the channel is closed.
+  template<typename ForwardIt>
+  size_t InsertValues(ForwardIt first, ForwardIt last) {
+    ZBASELIB_TRACE(CHANNEL, ZBASELIB_TRACE_VERBOSE, "InsertValues");
+    size_t remaining = std::distance(first, last);
+    size_t inserted = 0;
+    while (remaining > 0 && !is_closed) {
+      size_t n = buffer.PushN(first, remaining);
+      CoroutineRef co;
+      if (n == 0 && (co = CurrentCoroutine()).coroutine) {
+        CoroutineWait(this, false, co, [&]() {
+          return is_closed || (n = buffer.PushN(first, remaining)) > 0;
+        });
+        if (n == 0)
+          break;
+      } else if (n == 0) {
+        std::unique_lock<std::mutex> ulock(buffer_lock);
+        writer_waiting.fetch_add(1);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        while ((n = buffer.PushN(first, remaining)) == 0 && !is_closed)
+          writer_waiter.wait(ulock);
+        writer_waiting.fetch_sub(1);
+        if (n == 0)
+          break;
+      }
+      inserted += n;
+      remaining -= n;
+      NotifyReader(n);
     }
+    return inserted;
+  }
 
-    bool is_insert_succeed = buffer.Push(value);
-    if (is_insert_succeed) {
-      reader_waiter.notify_one();
-      return true;
-    } else
-      return false;
+  // blocked until at least one value is there, then take up to max values
+  // with one CAS and one wakeup. Returns 0 only if the channel is closed and
+  // empty.
+  template<typename OutputIt>
+  size_t GetNextValues(OutputIt out, size_t max) {
+    ZBASELIB_TRACE(CHANNEL, ZBASELIB_TRACE_VERBOSE, "GetNextValues");
+    if (max == 0)
+      return 0;
+
+    size_t n = buffer.PopN(out, max);
+    CoroutineRef co;
+    if (n == 0 && (co = CurrentCoroutine()).coroutine) {
+      CoroutineWait(this, true, co, [&]() {
+        return (n = buffer.PopN(out, max)) > 0 || is_closed;
+      });
+    } else if (n == 0) {
+      std::unique_lock<std::mutex> ulock(buffer_lock);
+      reader_waiting.fetch_add(1);
+      std::atomic_thread_fence(std::memory_order_seq_cst);
+      while ((n = buffer.PopN(out, max)) == 0 && !is_closed)
+        reader_waiter.wait(ulock);
+      reader_waiting.fetch_sub(1);
+    }
+    if (n > 0)
+      NotifyWriter(n);
+    return n;
   }
 
-  // fixme: change is_closed to atomic_bool
+  // nonblocked, take up to max values
+  template<typename OutputIt>
+  size_t TryGetNextValues(OutputIt out, size_t max) {
+    size_t n = buffer.PopN(out, max);
+    if (n > 0)
+      NotifyWriter(n);
+    return n;
+  }
+
+  // the values in the buffer are still received after Close()
   void Close() {
     is_closed = true;
-    // todo: why input_wait notify one, but output_wait notify all ?
-    reader_waiter.notify_one();
+    // the waiters check is_closed under buffer_lock
+    std::lock_guard<std::mutex> ulock(buffer_lock);
+    // every blocked reader and writer has to see the close
+    reader_waiter.notify_all();
     writer_waiter.notify_all();
+    select_readers.WakeAll();
+    select_writers.WakeAll();
   }
 
   bool IsClosed() {
     return is_closed;
   }
 
+  // a Select waits to read, the caller retries after adding the node,
+  // the fence pairs with the one in NotifyReader()
+  void AddReadSelect(SelectNode* node) {
+    std::lock_guard<std::mutex> ulock(buffer_lock);
+    select_readers.Add(node);
+    reader_waiting.fetch_add(1);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+  }
+
+  void RemoveReadSelect(SelectNode* node) {
+    std::lock_guard<std::mutex> ulock(buffer_lock);
+    select_readers.Remove(node);
+    reader_waiting.fetch_sub(1);
+  }
+
+  // a Select waits to write
+  void AddWriteSelect(SelectNode* node) {
+    std::lock_guard<std::mutex> ulock(buffer_lock);
+    select_writers.Add(node);
+    writer_waiting.fetch_add(1);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+  }
+
+  void RemoveWriteSelect(SelectNode* node) {
+    std::lock_guard<std::mutex> ulock(buffer_lock);
+    select_writers.Remove(node);
+    writer_waiting.fetch_sub(1);
+  }
+
 private:
+  // wake blocked readers after n values are inserted
+  void NotifyReader(size_t n = 1) {
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (reader_waiting.load(std::memory_order_relaxed) == 0)
+      return;
+    // the reader may be between its check and wait(), it holds the lock there
+    std::lock_guard<std::mutex> ulock(buffer_lock);
+    if (n == 1)
+      reader_waiter.notify_one();
+    else
+      reader_waiter.notify_all();
+    select_readers.WakeAll();
+  }
+
+  // wake blocked writers after n values are taken
+  void NotifyWriter(size_t n = 1) {
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (writer_waiting.load(std::memory_order_relaxed) == 0)
+      return;
+    std::lock_guard<std::mutex> ulock(buffer_lock);
+    if (n == 1)
+      writer_waiter.notify_one();
+    else
+      writer_waiter.notify_all();
+    select_writers.WakeAll();
+  }
+
   LockFreeCircularBuffer<T, buffer_size> buffer;
   std::mutex buffer_lock;
   std::condition_variable reader_waiter; // wait to read
   std::condition_variable writer_waiter; // wait to write
+  SelectList select_readers;             // selects wait to read
+  SelectList select_writers;             // selects wait to write
+  std::atomic_bool is_closed;
+  std::atomic<int> reader_waiting;       // number of blocked readers
+  std::atomic<int> writer_waiting;       // number of blocked writers
+};
+
+
+// Unbuffered channel. There is no buffer at all, a sender blocks until a
+// receiver takes its value, and the value is moved directly from the
+// sender's stack into the receiver's stack. Whichever side comes first
+// queues a Waiter which points to its stack slot, the other side finishes
+// the handoff and wakes it.
+//
+// A Select never queues a Waiter, its parked SelectNode offers a value slot
+// instead. The other end takes a queued Waiter first, then claims a parked
+// Select and finishes its case, so two Selects on the two ends can meet.
+template<typename T>
+class ChannelBuffer<T, 0> {
+public:
+  explicit ChannelBuffer(size_t capacity = 0) : is_closed(false) {
+    assert(capacity == 0);
+  }
+
+  ~ChannelBuffer() = default;
+
+  // blocked, T{} when the channel is closed
+  T GetNextValue() {
+    T value;
+    if (!GetNextValue(&value))
+      return {};
+    return value;
+  }
+
+  // blocked, false when the channel is closed
+  bool GetNextValue(T* value) {
+    ZBASELIB_TRACE(CHANNEL, ZBASELIB_TRACE_VERBOSE, "GetNextValue");
+    std::unique_lock<std::mutex> ulock(buffer_lock);
+    if (is_closed)
+      return false;
+
+    Waiter* sender = senders.PopFront();
+    if (sender) {
+      *value = std::move(*sender->value);
+      sender->Wake();
+      return true;
+    }
+
+    return WaitSender(value, ulock);
+  }
+
+  // nonblocked, only succeed when a sender is waiting
+  std::unique_ptr<T> TryGetNextValue() {
+    T value;
+    if (!TryGetNextValue(&value))
+      return nullptr;
+    return std::make_unique<T>(std::move(value));
+  }
+
+  // see the buffered ChannelBuffer
+  bool TryGetNextValue(T* value, bool* ok = nullptr) {
+    std::unique_lock<std::mutex> ulock(buffer_lock);
+    if (is_closed) {
+      *value = T{};
+      if (ok)
+        *ok = false;
+      return true;
+    }
+
+    Waiter* sender = senders.PopFront();
+    if (sender) {
+      *value = std::move(*sender->value);
+      sender->Wake();
+    } else {
+      SelectNode* node = select_writers.Claim();
+      if (node == nullptr)
+        return false;
+      *value = std::move(*static_cast<T*>(node->value));
+      node->waiter->Wake();
+    }
+    if (ok)
+      *ok = true;
+    return true;
+  }
+
+  // blocked
+  void InsertValue(T value) {
+    ZBASELIB_TRACE(CHANNEL, ZBASELIB_TRACE_VERBOSE, "InsertValue");
+    std::unique_lock<std::mutex> ulock(buffer_lock);
+    if (is_closed)
+      return;
+
+    Waiter* receiver = receivers.PopFront();
+    if (receiver) {
+      *receiver->value = std::move(value);
+      receiver->Wake();
+      return;
+    }
+
+    WaitReceiver(value, ulock);
+  }
+
+  // blocked until deadline, false if timeout or the channel is closed
+  template<typename Clock, typename Duration>
+  bool GetNextValueUntil(T* value, const std::chrono::time_point<Clock, Duration>& deadline) {
+    ZBASELIB_TRACE(CHANNEL, ZBASELIB_TRACE_VERBOSE, "GetNextValueUntil");
+    std::unique_lock<std::mutex> ulock(buffer_lock);
+    if (is_closed)
+      return false;
+
+    Waiter* sender = senders.PopFront();
+    if (sender) {
+      *value = std::move(*sender->value);
+      sender->Wake();
+      return true;
+    }
+
+    Waiter receiver(value);
+    receivers.PushBack(&receiver);
+    select_writers.WakeAll();
+    while (!receiver.is_done && !is_closed) {
+      if (receiver.cond.wait_until(ulock, deadline) == std::cv_status::timeout)
+        break;
+    }
+    if (!receiver.is_done && !is_closed)
+      receivers.Remove(&receiver);
+    return receiver.is_done;
+  }
+
+  // blocked until a receiver takes the value or deadline
+  template<typename Clock, typename Duration>
+  bool InsertValueUntil(T value, const std::chrono::time_point<Clock, Duration>& deadline) {
+    ZBASELIB_TRACE(CHANNEL, ZBASELIB_TRACE_VERBOSE, "InsertValueUntil");
+    std::unique_lock<std::mutex> ulock(buffer_lock);
+    if (is_closed)
+      return false;
+
+    Waiter* receiver = receivers.PopFront();
+    if (receiver) {
+      *receiver->value = std::move(value);
+      receiver->Wake();
+      return true;
+    }
+
+    Waiter sender(&value);
+    senders.PushBack(&sender);
+    select_readers.WakeAll();
+    while (!sender.is_done && !is_closed) {
+      if (sender.cond.wait_until(ulock, deadline) == std::cv_status::timeout)
+        break;
+    }
+    if (!sender.is_done && !is_closed)
+      senders.Remove(&sender);
+    return sender.is_done;
+  }
+
+  // nonblocked, only succeed when a receiver is waiting
+  bool TryInsertValue(T value) {
+    ZBASELIB_TRACE(CHANNEL, ZBASELIB_TRACE_VERBOSE, "TryInsert");
+    std::unique_lock<std::mutex> ulock(buffer_lock);
+    if (is_closed)
+      return false;
+
+    Waiter* receiver = receivers.PopFront();
+    if (receiver) {
+      *receiver->value = std::move(value);
+      receiver->Wake();
+      return true;
+    }
+
+    SelectNode* node = select_readers.Claim();
+    if (node == nullptr)
+      return false;
+    *static_cast<T*>(node->value) = std::move(value);
+    node->waiter->Wake();
+    return true;
+  }
+
+  // blocked, hand the values to the waiting receivers under one lock, and
+  // wait like InsertValue() when there is no receiver
+  template<typename ForwardIt>
+  size_t InsertValues(ForwardIt first, ForwardIt last) {
+    ZBASELIB_TRACE(CHANNEL, ZBASELIB_TRACE_VERBOSE, "InsertValues");
+    std::unique_lock<std::mutex> ulock(buffer_lock);
+    size_t inserted = 0;
+    for (; first != last && !is_closed; ++first) {
+      Waiter* receiver = receivers.PopFront();
+      if (receiver) {
+        *receiver->value = *first;
+        receiver->Wake();
+        inserted++;
+        continue;
+      }
+
+      T value = *first;
+      if (!WaitReceiver(value, ulock))
+        break;
+      inserted++;
+    }
+    return inserted;
+  }
+
+  // blocked, take the values of the waiting senders under one lock, or wait
+  // for one sender like GetNextValue()
+  template<typename OutputIt>
+  size_t GetNextValues(OutputIt out, size_t max) {
+    ZBASELIB_TRACE(CHANNEL, ZBASELIB_TRACE_VERBOSE, "GetNextValues");
+    std::unique_lock<std::mutex> ulock(buffer_lock);
+    size_t n = TakeSenders(out, max);
+    if (n > 0 || max == 0 || is_closed)
+      return n;
+
+    T value;
+    if (!WaitSender(&value, ulock))
+      return 0;
+    *out = std::move(value);
+    return 1;
+  }
+
+  // nonblocked, take the values of the waiting senders
+  template<typename OutputIt>
+  size_t TryGetNextValues(OutputIt out, size_t max) {
+    std::unique_lock<std::mutex> ulock(buffer_lock);
+    return TakeSenders(out, max);
+  }
+
+  void Close() {
+    std::unique_lock<std::mutex> ulock(buffer_lock);
+    is_closed = true;
+    // a woken waiter returns and its stack is gone, so unlink all of them
+    Waiter* waiter = nullptr;
+    while ((waiter = receivers.PopFront()) != nullptr)
+      waiter->Notify();
+    while ((waiter = senders.PopFront()) != nullptr)
+      waiter->Notify();
+    select_readers.WakeAll();
+    select_writers.WakeAll();
+  }
+
+  bool IsClosed() {
+    return is_closed;
+  }
+
+  // a Select waits for a sender. The selects of the other end may have
+  // missed the node before it was open, so they retry.
+  void AddReadSelect(SelectNode* node) {
+    std::lock_guard<std::mutex> ulock(buffer_lock);
+    select_readers.Add(node);
+    if (node->value)
+      select_writers.WakeAll(node->waiter);
+  }
+
+  void RemoveReadSelect(SelectNode* node) {
+    std::lock_guard<std::mutex> ulock(buffer_lock);
+    select_readers.Remove(node);
+  }
+
+  // a Select waits for a receiver
+  void AddWriteSelect(SelectNode* node) {
+    std::lock_guard<std::mutex> ulock(buffer_lock);
+    select_writers.Add(node);
+    if (node->value)
+      select_readers.WakeAll(node->waiter);
+  }
+
+  void RemoveWriteSelect(SelectNode* node) {
+    std::lock_guard<std::mutex> ulock(buffer_lock);
+    select_writers.Remove(node);
+  }
+
+private:
+  // must be called with buffer_lock held
+  template<typename OutputIt>
+  size_t TakeSenders(OutputIt& out, size_t max) {
+    size_t n = 0;
+    Waiter* sender = nullptr;
+    while (n < max && (sender = senders.PopFront()) != nullptr) {
+      *out = std::move(*sender->value);
+      ++out;
+      sender->Wake();
+      n++;
+    }
+    return n;
+  }
+
+  // a blocked sender or receiver, lives on its stack
+  struct Waiter {
+    T* value;                     // the value to send, or where to receive
+    bool is_done;                 // the handoff is finished
+    std::condition_variable cond;
+    CoroutineRef co;              // the blocked coroutine, if it is one
+    Waiter* next;
+
+    explicit Waiter(T* value, CoroutineRef co = CoroutineRef()) :
+      value(value), is_done(false), co(co), next(nullptr) {}
+
+    // wait for Notify(), may return spuriously
+    void Wait(std::unique_lock<std::mutex>& ulock) {
+      if (co.coroutine) {
+        ulock.unlock();
+        co.hook->Suspend();
+        ulock.lock();
+      } else {
+        cond.wait(ulock);
+      }
+    }
+
+    // must be called with buffer_lock held, the waiter may return and
+    // destroy itself as soon as the lock is released
+    void Notify() {
+      if (co.coroutine)
+        co.hook->Resume(co.coroutine);
+      else
+        cond.notify_one();
+    }
+
+    void Wake() {
+      is_done = true;
+      Notify();
+    }
+  };
+
+  // the waiter of a coroutine. A suspended coroutine may have its stack
+  // copied out and the memory reused, so its waiter and value must not be
+  // on its stack.
+  struct HeapWaiter {
+    T value;
+    Waiter waiter;
+
+    explicit HeapWaiter(CoroutineRef co) : waiter(&value, co) {}
+  };
+
+
+  // intrusive FIFO of waiters, no allocation
+  struct WaiterQueue {
+    Waiter* head = nullptr;
+    Waiter* tail = nullptr;
+
+    void PushBack(Waiter* waiter) {
+      if (tail)
+        tail->next = waiter;
+      else
+        head = waiter;
+      tail = waiter;
+    }
+
+    Waiter* PopFront() {
+      Waiter* waiter = head;
+      if (waiter) {
+        head = waiter->next;
+        if (head == nullptr)
+          tail = nullptr;
+        waiter->next = nullptr;
+      }
+      return waiter;
+    }
+
+    // a timed out waiter leaves the queue, the queue is short
+    void Remove(Waiter* waiter) {
+      Waiter* prev = nullptr;
+      for (Waiter* cur = head; cur; prev = cur, cur = cur->next) {
+        if (cur != waiter)
+          continue;
+        if (prev)
+          prev->next = cur->next;
+        else
+          head = cur->next;
+        if (tail == cur)
+          tail = prev;
+        cur->next = nullptr;
+        return;
+      }
+    }
+  };
+
+  // must be called with buffer_lock held, queue waiter and wait for the
+  // handoff. False if the channel is closed first.
+  bool WaitHandoff(WaiterQueue& queue, SelectList& selects, Waiter* waiter,
+                   std::unique_lock<std::mutex>& ulock) {
+    queue.PushBack(waiter);
+    selects.WakeAll();
+    while (!waiter->is_done && !is_closed)
+      waiter->Wait(ulock);
+    return waiter->is_done;
+  }
+
+  // must be called with buffer_lock held, block until a receiver takes
+  // value. False if the channel is closed first.
+  bool WaitReceiver(T& value, std::unique_lock<std::mutex>& ulock) {
+    CoroutineRef co = CurrentCoroutine();
+    if (co.coroutine) {
+      std::unique_ptr<HeapWaiter> sender(new HeapWaiter(co));
+      sender->value = std::move(value);
+      return WaitHandoff(senders, select_readers, &sender->waiter, ulock);
+    }
+
+    Waiter sender(&value);
+    return WaitHandoff(senders, select_readers, &sender, ulock);
+  }
+
+  // must be called with buffer_lock held, block until a sender hands a
+  // value to us. False if the channel is closed first.
+  bool WaitSender(T* value, std::unique_lock<std::mutex>& ulock) {
+    CoroutineRef co = CurrentCoroutine();
+    if (co.coroutine) {
+      std::unique_ptr<HeapWaiter> receiver(new HeapWaiter(co));
+      if (!WaitHandoff(receivers, select_writers, &receiver->waiter, ulock))
+        return false;
+      *value = std::move(receiver->value);
+      return true;
+    }
+
+    Waiter receiver(value);
+    return WaitHandoff(receivers, select_writers, &receiver, ulock);
+  }
+
+  std::mutex buffer_lock;
+  WaiterQueue senders;     // blocked senders, oldest first
+  WaiterQueue receivers;   // blocked receivers, oldest first
+  SelectList select_readers;
+  SelectList select_writers;
   std::atomic_bool is_closed;
 };
   
 } // namespace internal
 
 
+inline void SetCoroutineHook(CoroutineHook* hook) {
+  internal::ThreadCoroutineHook() = hook;
+}
+
+
 class Case;
-template<typename T, size_t buffer_size> class Chan;
-template<typename T, size_t buffer_size> class OChan;
-template<typename T, size_t buffer_size> class IChan;
+template<typename T, size_t buffer_size = dynamic_buffer_size> class Chan;
+template<typename T, size_t buffer_size = dynamic_buffer_size> class OChan;
+template<typename T, size_t buffer_size = dynamic_buffer_size> class IChan;
+
+namespace internal {
+struct ChanAccess;
+
+// a receive case calls f(value, ok) if f takes two parameters, like
+// v, ok := <-ch of Go, otherwise f(value)
+template<typename FUNC, typename T>
+auto CallRecv(FUNC& f, T& value, bool ok, int) -> decltype(f(value, ok), void()) {
+  f(value, ok);
+}
+
+template<typename FUNC, typename T>
+void CallRecv(FUNC& f, T& value, bool, long) {
+  f(value);
+}
+
+// xorshift32, seeded once per thread, cheap enough to pick the first case
+// of every Select
+inline uint32_t SelectRandom() {
+  static thread_local uint32_t state = static_cast<uint32_t>(
+    std::hash<std::thread::id>()(std::this_thread::get_id())) | 1;
+  state ^= state << 13;
+  state ^= state >> 17;
+  state ^= state << 5;
+  return state;
+}
+} // namespace internal
 
   
+// task() tries the case once and returns true when it is not ready.
+// watch(node, true) adds the case to the select list of its channel, and
+// watch(node, false) removes it. fire() finishes the case after the other end
+// of an unbuffered channel claimed it, the value is in slot.
 class Case {
 public:
   template<typename T, size_t buffer_size, typename FUNC>
   Case(IChan<T, buffer_size> ch, FUNC f) {
-    std::cout << "Case cons(IChan)" << std::endl;
+    ZBASELIB_TRACE(CHANNEL, ZBASELIB_TRACE_VERBOSE, "Case cons(IChan)");
+    std::shared_ptr<T> slot = buffer_size == 0 ? std::make_shared<T>() : nullptr;
     task = [=]() {
-      std::cout << "Case IChan" << std::endl;
-      auto value_ptr = ch.buffer->TryGetNextValue();
-      if (value_ptr) {
-	      f(*value_ptr);
-      };
-      return value_ptr == nullptr;
+      ZBASELIB_TRACE(CHANNEL, ZBASELIB_TRACE_VERBOSE, "Case IChan");
+      T value;
+      bool ok = false;
+      if (!ch.buffer->TryGetNextValue(&value, &ok))
+        return true;
+      internal::CallRecv(f, value, ok, 0);
+      return false;
+    };
+    watch = [=](internal::SelectNode* node, bool add) {
+      if (add) {
+        node->value = slot.get();
+        ch.buffer->AddReadSelect(node);
+      } else {
+        ch.buffer->RemoveReadSelect(node);
+      }
+    };
+    fire = [=]() {
+      internal::CallRecv(f, *slot, true, 0);
     };
   }
 
+  // the value has been sent by ch << value before the Select, so the case
+  // is always ready
   template<typename T, size_t buffer_size, typename FUNC>
   Case(OChan<T, buffer_size> ch, FUNC f) {
-    std::cout << "Case cons(OChan)" << std::endl;
+    ZBASELIB_TRACE(CHANNEL, ZBASELIB_TRACE_VERBOSE, "Case cons(OChan)");
     task = [=]() {
-      std::cout << "Case OChan" << std::endl;
+      ZBASELIB_TRACE(CHANNEL, ZBASELIB_TRACE_VERBOSE, "Case OChan");
       f();
-      return true;
+      return false;
     };
+    watch = [](internal::SelectNode*, bool) {};
+  }
+
+  // send value when the channel can take it
+  template<typename T, size_t buffer_size, typename FUNC>
+  Case(OChan<T, buffer_size> ch, const T& value, FUNC f) {
+    ZBASELIB_TRACE(CHANNEL, ZBASELIB_TRACE_VERBOSE, "Case cons(OChan, value)");
+    std::shared_ptr<T> slot = buffer_size == 0 ? std::make_shared<T>(value) : nullptr;
+    task = [=]() {
+      ZBASELIB_TRACE(CHANNEL, ZBASELIB_TRACE_VERBOSE, "Case OChan value");
+      if (!ch.buffer->TryInsertValue(value))
+        return true;
+      f();
+      return false;
+    };
+    watch = [=](internal::SelectNode* node, bool add) {
+      if (add) {
+        node->value = slot.get();
+        ch.buffer->AddWriteSelect(node);
+      } else {
+        ch.buffer->RemoveWriteSelect(node);
+      }
+    };
+    fire = f;
   }
 
   template<typename T, size_t buffer_size, typename FUNC>
   Case(Chan<T, buffer_size> ch, FUNC f) :
     Case(IChan<T, buffer_size>(ch), std::forward<FUNC>(f)) {
-      std::cout << "Case Chan" << std::endl;
+      ZBASELIB_TRACE(CHANNEL, ZBASELIB_TRACE_VERBOSE, "Case Chan");
   }
 
-  Case(const Case&) = default;
+  template<typename T, size_t buffer_size, typename FUNC>
+  Case(Chan<T, buffer_size> ch, const T& value, FUNC f) :
+    Case(OChan<T, buffer_size>(ch), value, std::forward<FUNC>(f)) {
+      ZBASELIB_TRACE(CHANNEL, ZBASELIB_TRACE_VERBOSE, "Case Chan value");
+  }
+
+  // the node is linked in a channel while watched, it is never copied
+  Case(const Case& cas) : task(cas.task), watch(cas.watch), fire(cas.fire) {}
+  Case& operator=(const Case&) = delete;
   
   Case() {
-    std::cout << "Case cons()" << std::endl;
+    ZBASELIB_TRACE(CHANNEL, ZBASELIB_TRACE_VERBOSE, "Case cons()");
     task = []() {
-      std::cout << "Case() task" << std::endl;
+      ZBASELIB_TRACE(CHANNEL, ZBASELIB_TRACE_VERBOSE, "Case() task");
       return true;
     };
+    watch = [](internal::SelectNode*, bool) {};
   }
   
   bool operator() () {
-    std::cout << "Case operator()" << std::endl;
+    ZBASELIB_TRACE(CHANNEL, ZBASELIB_TRACE_VERBOSE, "Case operator()");
     return task();
   }
+
+  void Watch(internal::SelectWaiter* waiter) {
+    node.waiter = waiter;
+    watch(&node, true);
+  }
+
+  // the node keeps its waiter until it is unlinked under the channel lock
+  void Unwatch() {
+    watch(&node, false);
+  }
+
+  // returns false if fired is not the node of this case
+  bool Fire(const internal::SelectNode* fired) {
+    if (fired != &node)
+      return false;
+    fire();
+    return true;
+  }
   
 private:
   std::function<bool()> task;
+  std::function<void(internal::SelectNode*, bool)> watch;
+  std::function<void()> fire;
+  internal::SelectNode node;
 };
 
 
@@ -362,12 +1377,12 @@ class Default {
 public:
   template<typename FUNC>
   Default(FUNC f) {
-    std::cout << "Default()" << std::endl;
+    ZBASELIB_TRACE(CHANNEL, ZBASELIB_TRACE_VERBOSE, "Default()");
     task = f;
   }
 
   void operator() () {
-    std::cout << "Default operator()" << std::endl;
+    ZBASELIB_TRACE(CHANNEL, ZBASELIB_TRACE_VERBOSE, "Default operator()");
     task();
   }
 
@@ -376,42 +1391,99 @@ private:
 };
 
 
+// Execute exactly one ready case. Every Case type-erases its channel and
+// function, use FastSelect on hot paths. Without Default a Select blocks until one
+// of the cases is ready: it adds one waiter to every channel, tries the
+// cases again, then parks until a channel wakes it, and removes the waiter
+// from all the channels before it retries. A blocked Select uses no cpu.
 class Select {
 public:
   template<typename ...T>
   Select(T&&... params) {
-    std::cout << "Select ------------------" << std::endl;
+    ZBASELIB_TRACE(CHANNEL, ZBASELIB_TRACE_VERBOSE, "Select");
     cases.reserve(sizeof...(params));
     Execute(std::forward<T>(params)...);
   }
 
 private:
   bool RandomExecute() {
-    std::cout << "RandomExecute" << std::endl;
-    std::random_device rd;
-    std::mt19937 g(rd());
-    std::shuffle(std::begin(cases), std::end(cases), g);
-    for (auto& cas : cases) {
-      if (!cas()) return true;
+    ZBASELIB_TRACE(CHANNEL, ZBASELIB_TRACE_VERBOSE, "RandomExecute");
+    // start from a random case, the cases can not be moved while they are
+    // watched
+    size_t start = internal::SelectRandom() % cases.size();
+    for (size_t i = 0; i < cases.size(); i++) {
+      if (!cases[(start + i) % cases.size()]()) return true;
     }
     return false;
   }
 
+  void BlockingExecute() {
+    if (RandomExecute())
+      return;
+
+    // the stack of a suspended coroutine may be swapped out, the cases are
+    // on the heap already
+    internal::CoroutineRef co = internal::CurrentCoroutine();
+    std::unique_ptr<internal::SelectWaiter> heap_waiter;
+    internal::SelectWaiter stack_waiter;
+    internal::SelectWaiter& waiter = co.coroutine ?
+      *(heap_waiter = std::make_unique<internal::SelectWaiter>(co)) : stack_waiter;
+
+    while (true) {
+      ZBASELIB_TRACE(CHANNEL, ZBASELIB_TRACE_VERBOSE, "Select park");
+      waiter.Reset();
+      for (auto& cas : cases)
+        cas.Watch(&waiter);
+
+      // a case may become ready before it is watched, and the case may
+      // throw, so unwatch whatever happens
+      struct UnwatchGuard {
+        std::vector<Case>& cases;
+        ~UnwatchGuard() {
+          for (auto& cas : cases)
+            cas.Unwatch();
+        }
+      };
+      internal::SelectNode* fired = nullptr;
+      {
+        UnwatchGuard guard{cases};
+        if (RandomExecute())
+          return;
+        waiter.Open();
+        waiter.Park();
+        fired = waiter.Close();
+      }
+
+      // the claimer holds the channel lock until the value is moved, so
+      // the case is finished once it is unwatched
+      if (fired) {
+        for (auto& cas : cases) {
+          if (cas.Fire(fired))
+            return;
+        }
+      }
+
+      // another thread may take the value first, then wait again
+      if (RandomExecute())
+        return;
+    }
+  }
+
   template<typename ...T>
   void Execute(Case&& cas, T&&... params) {
-    std::cout << "Execute 1" << std::endl;
+    ZBASELIB_TRACE(CHANNEL, ZBASELIB_TRACE_VERBOSE, "Execute 1");
     cases.emplace_back(cas);
     Execute(std::forward<T>(params)...);
   }
 
   void Execute(Case&& cas) {
-    std::cout << "Execute 2" << std::endl;
+    ZBASELIB_TRACE(CHANNEL, ZBASELIB_TRACE_VERBOSE, "Execute 2");
     cases.emplace_back(cas);
-    RandomExecute();
+    BlockingExecute();
   }
 
   void Execute(Default&& defaul) {
-    std::cout << "Execute Default" << std::endl;
+    ZBASELIB_TRACE(CHANNEL, ZBASELIB_TRACE_VERBOSE, "Execute Default");
     if (!RandomExecute())
       defaul();
   }
@@ -432,17 +1504,19 @@ void Close(OChan<T, buffer_size> ch) {
 }
 
 // todo: can we use it now ? maybe it it unavailable 
-template<typename T, size_t buffer_size = 1>
+template<typename T, size_t buffer_size = dynamic_buffer_size>
 Chan<T, buffer_size>&& make_Chan() {
   return Chan<T, buffer_size>();
 }
 
 
+// Input iterator of an IChan, it reaches end() when the channel is closed
+// and all the values sent before Close() are received.
 template<typename T, size_t buffer_size = 0>
 class IChan_Iterator : public std::iterator<std::input_iterator_tag, T> {
 public:
   IChan_Iterator(std::shared_ptr<internal::ChannelBuffer<T, buffer_size>> buff, bool is_end = false) :
-    buffer(buff) {
+    buffer(buff), is_end(is_end) {
     if (!is_end) operator++();
   }
 
@@ -453,7 +1527,7 @@ public:
   }
 
   IChan_Iterator& operator++() {
-    value = buffer->GetNextValue();
+    is_end = !buffer->GetNextValue(&value);
     return *this;
   }
 
@@ -464,7 +1538,7 @@ public:
   }
 
   inline bool operator==(const IChan_Iterator& rhs) const {
-    return buffer->IsClosed();
+    return is_end == rhs.is_end && (is_end || buffer == rhs.buffer);
   }
 
   inline bool operator!=(const IChan_Iterator& rhs) const {
@@ -475,6 +1549,7 @@ public:
 private:
   std::shared_ptr<internal::ChannelBuffer<T, buffer_size>> buffer;
   T value;
+  bool is_end;
 };
 
 
@@ -488,6 +1563,7 @@ protected:
 
 public:
   friend class zbaselib::Case;
+  friend struct internal::ChanAccess;
   
   IChan() = default;
 
@@ -499,20 +1575,20 @@ public:
   }
 
   friend IChan<T, buffer_size>& operator>> (IChan<T, buffer_size>& ch, T& obj) {
-    std::cout << "Chan >> obj" << std::endl;
+    ZBASELIB_TRACE(CHANNEL, ZBASELIB_TRACE_VERBOSE, "Chan >> obj");
     obj = ch.buffer->GetNextValue();
     return ch;
   }
 
   friend IChan<T, buffer_size>& operator<< (T& obj, IChan<T, buffer_size>& ch) {
-    std::cout << "obj << Chan" << std::endl;
+    ZBASELIB_TRACE(CHANNEL, ZBASELIB_TRACE_VERBOSE, "obj << Chan");
     obj = ch.buffer->GetNextValue();
     return ch;
   }
 
   template<size_t out_buffer_size>
   friend IChan<T, buffer_size>& operator>> (IChan<T, buffer_size>& ch, OChan<T, out_buffer_size>& out_ch) {
-    std::cout << "Chan >> Chan" << std::endl;
+    ZBASELIB_TRACE(CHANNEL, ZBASELIB_TRACE_VERBOSE, "Chan >> Chan");
     T temp;
     ch >> temp;
     out_ch << temp;
@@ -521,7 +1597,7 @@ public:
 
   template<size_t out_buffer_size>
   friend IChan<T, buffer_size>& operator<< (OChan<T, out_buffer_size>& out_ch, IChan<T, buffer_size>& ch) {
-    std::cout << "Chan << Chan" << std::endl;
+    ZBASELIB_TRACE(CHANNEL, ZBASELIB_TRACE_VERBOSE, "Chan << Chan");
     T temp;
     ch >> temp;
     out_ch << temp;
@@ -529,7 +1605,7 @@ public:
   }
 
   friend std::istream& operator>> (std::istream& is, IChan<T, buffer_size>& ch) {
-    std::cout << "istream >> Chan" << std::endl;
+    ZBASELIB_TRACE(CHANNEL, ZBASELIB_TRACE_VERBOSE, "istream >> Chan");
     T temp;
     is >> temp;
     ch << temp;
@@ -546,6 +1622,47 @@ public:
   IChan_EndIterator end() {
     return { buffer, true };
   }
+
+  // receive a value, like v, ok := <-ch of Go. ok is false when the
+  // channel is closed and drained, the value is T{} then.
+  std::pair<T, bool> Recv() {
+    std::pair<T, bool> result;
+    result.second = buffer->GetNextValue(&result.first);
+    return result;
+  }
+
+  // nonblocked, ok is false when nothing is received
+  std::pair<T, bool> TryRecv() {
+    std::pair<T, bool> result;
+    bool ok = false;
+    result.second = buffer->TryGetNextValue(&result.first, &ok) && ok;
+    return result;
+  }
+
+  // receive a value, false if it times out or the channel is closed
+  template<typename Rep, typename Period>
+  bool RecvFor(T& obj, const std::chrono::duration<Rep, Period>& timeout) {
+    return RecvUntil(obj, std::chrono::steady_clock::now() + timeout);
+  }
+
+  template<typename Clock, typename Duration>
+  bool RecvUntil(T& obj, const std::chrono::time_point<Clock, Duration>& deadline) {
+    return buffer->GetNextValueUntil(&obj, deadline);
+  }
+
+  // block until at least one value is there, then receive up to max values
+  // into out at once. Returns 0 only if the channel is closed and empty.
+  template<typename OutputIt>
+  size_t RecvBatch(OutputIt out, size_t max) {
+    return buffer->GetNextValues(out, max);
+  }
+
+  // receive all the values which are there without blocking, append them
+  // to container
+  template<typename Container>
+  size_t DrainInto(Container& container) {
+    return buffer->TryGetNextValues(std::back_inserter(container), SIZE_MAX);
+  }
 };  
 
 
@@ -558,6 +1675,9 @@ protected:
     : buffer(buff) {}
 
 public:
+  friend class zbaselib::Case;
+  friend struct internal::ChanAccess;
+
   OChan() = default;
 
   OChan(const OChan<T, buffer_size>& ch) = default;
@@ -567,20 +1687,20 @@ public:
   }
 
   friend OChan<T, buffer_size>& operator<< (OChan<T, buffer_size>& ch, const T& obj) {
-    std::cout << "Chan << obj" << std::endl;
+    ZBASELIB_TRACE(CHANNEL, ZBASELIB_TRACE_VERBOSE, "Chan << obj");
     ch.buffer->InsertValue(obj);
     return ch;
   }
 
   friend OChan<T, buffer_size>& operator>> (const T& obj, OChan<T, buffer_size>& ch) {
-    std::cout << "obj >> Chan" << std::endl;
+    ZBASELIB_TRACE(CHANNEL, ZBASELIB_TRACE_VERBOSE, "obj >> Chan");
     ch.buffer->InsertValue();
     return ch;
   }
 
   template<size_t in_buffer_size>
   friend OChan<T, buffer_size>& operator<< (OChan<T, buffer_size>& out_ch, const IChan<T, in_buffer_size>& in_ch) {
-    std::cout << "Chan << Chan" << std::endl;
+    ZBASELIB_TRACE(CHANNEL, ZBASELIB_TRACE_VERBOSE, "Chan << Chan");
     T temp;
     temp << in_ch;
     out_ch << temp;
@@ -589,7 +1709,7 @@ public:
 
   template<size_t in_buffer_size>
   friend OChan<T, buffer_size>& operator>> (const IChan<T, in_buffer_size>& in_ch, OChan<T, buffer_size>& out_ch) {
-    std::cout << "Chan >> Chan" << std::endl;
+    ZBASELIB_TRACE(CHANNEL, ZBASELIB_TRACE_VERBOSE, "Chan >> Chan");
     T temp;
     temp << in_ch;
     out_ch << temp;
@@ -597,24 +1717,46 @@ public:
   }
 
   friend std::ostream& operator<< (std::ostream& os, OChan<T, buffer_size>& ch) {
-    std::cout << "ostream << Chan" << std::endl;
+    ZBASELIB_TRACE(CHANNEL, ZBASELIB_TRACE_VERBOSE, "ostream << Chan");
     os << ch.buffer->GetNextValue();
     return os;
   }
 
+  // send a value, false if it times out or the channel is closed
+  template<typename Rep, typename Period>
+  bool SendFor(const T& obj, const std::chrono::duration<Rep, Period>& timeout) {
+    return SendUntil(obj, std::chrono::steady_clock::now() + timeout);
+  }
+
+  template<typename Clock, typename Duration>
+  bool SendUntil(const T& obj, const std::chrono::time_point<Clock, Duration>& deadline) {
+    return buffer->InsertValueUntil(obj, deadline);
+  }
+
+  // send [first, last), blocking while the channel is full, as few batches
+  // as possible. Returns how many are sent, less only if the channel closes.
+  template<typename ForwardIt>
+  size_t SendBatch(ForwardIt first, ForwardIt last) {
+    return buffer->InsertValues(first, last);
+  }
+
   void Close() {
     buffer->Close();
   }
 };
 
 
-template<typename T, size_t buffer_size = 1>
+// Chan<T> has its capacity given at construction, 1 by default.
+// Chan<T, n> fixes the capacity at compile time, Chan<T, 0> is unbuffered.
+template<typename T, size_t buffer_size>
 class Chan : public IChan<T, buffer_size>, public OChan<T, buffer_size> {
 public:
-  Chan() {
+  Chan() : Chan(buffer_size == dynamic_buffer_size ? 1 : buffer_size) {}
+
+  explicit Chan(size_t capacity) {
     // IChan and OChan use the common ChannelBuffer
     Chan::IChan::buffer = Chan::OChan::buffer
-      = std::make_shared<internal::ChannelBuffer<T, buffer_size>>();
+      = std::make_shared<internal::ChannelBuffer<T, buffer_size>>(capacity);
   }
 
   ~Chan() = default;
@@ -636,4 +1778,305 @@ public:
   }
 };
 
+
+// A channel which receives the current time once duration has passed, like
+// time.After of Go. Use it as the timeout case of a Select:
+//   Select { Case { ch, f }, Case { After(std::chrono::milliseconds(10)), g } };
+// All the timers share the wheel of GetTimerWheel().
+//
+// The timer and its channel stay in the wheel until it expires, even when
+// the Select picks another case. A loop which selects with a long timeout
+// should take the id of the timer and cancel it:
+//   TimerWheel::TimerId id;
+//   auto timeout = After(std::chrono::seconds(10), &id);
+//   Select { Case { ch, f }, Case { timeout, g } };
+//   GetTimerWheel().CancelTimer(id);
+template<typename Rep, typename Period>
+Chan<std::chrono::steady_clock::time_point> After(const std::chrono::duration<Rep, Period>& duration,
+                                                  TimerWheel::TimerId* timer_id = nullptr) {
+  Chan<std::chrono::steady_clock::time_point> ch(1);
+  TimerWheel::TimerId id = GetTimerWheel().AddTimer(duration, [ch]() mutable {
+    // the only value of a channel of capacity 1, never blocks
+    ch << std::chrono::steady_clock::now();
+  });
+  if (timer_id)
+    *timer_id = id;
+  return ch;
+}
+
+
+namespace internal {
+
+struct ChanAccess {
+  template<typename T, size_t buffer_size>
+  static ChannelBuffer<T, buffer_size>* Buffer(const IChan<T, buffer_size>& ch) {
+    return ch.buffer.get();
+  }
+
+  template<typename T, size_t buffer_size>
+  static ChannelBuffer<T, buffer_size>* Buffer(const OChan<T, buffer_size>& ch) {
+    return ch.buffer.get();
+  }
+};
+
+// Try() executes the case and returns true when it is ready. A blocked
+// FastSelect keeps one Slot per case, the other end of an unbuffered
+// channel moves the value through it and the case is finished by Fire().
+
+template<typename T, size_t buffer_size, typename FUNC>
+class RecvCaseImpl {
+public:
+  typedef T Slot;
+
+  RecvCaseImpl(ChannelBuffer<T, buffer_size>* buffer, FUNC f) :
+    buffer(buffer), f(std::move(f)) {}
+
+  bool Try() {
+    T value;
+    bool ok = false;
+    if (!buffer->TryGetNextValue(&value, &ok))
+      return false;
+    CallRecv(f, value, ok, 0);
+    return true;
+  }
+
+  void Watch(SelectNode* node, T* slot) {
+    node->value = buffer_size == 0 ? slot : nullptr;
+    buffer->AddReadSelect(node);
+  }
+
+  void Fire(T* slot) {
+    CallRecv(f, *slot, true, 0);
+  }
+
+  void Unwatch(SelectNode* node) {
+    buffer->RemoveReadSelect(node);
+  }
+
+private:
+  ChannelBuffer<T, buffer_size>* buffer;
+  FUNC f;
+};
+
+template<typename T, size_t buffer_size, typename FUNC>
+class SendCaseImpl {
+public:
+  typedef T Slot;
+
+  SendCaseImpl(ChannelBuffer<T, buffer_size>* buffer, const T& value, FUNC f) :
+    buffer(buffer), value(value), f(std::move(f)) {}
+
+  bool Try() {
+    if (!buffer->TryInsertValue(value))
+      return false;
+    f();
+    return true;
+  }
+
+  void Watch(SelectNode* node, T* slot) {
+    node->value = nullptr;
+    if (buffer_size == 0) {
+      *slot = value;
+      node->value = slot;
+    }
+    buffer->AddWriteSelect(node);
+  }
+
+  void Fire(T*) {
+    f();
+  }
+
+  void Unwatch(SelectNode* node) {
+    buffer->RemoveWriteSelect(node);
+  }
+
+private:
+  ChannelBuffer<T, buffer_size>* buffer;
+  T value;
+  FUNC f;
+};
+
+template<typename FUNC>
+class DefaultCaseImpl {
+public:
+  explicit DefaultCaseImpl(FUNC f) : f(std::move(f)) {}
+
+  void operator() () {
+    f();
+  }
+
+private:
+  FUNC f;
+};
+
+template<typename CASE>
+struct IsDefaultCase : std::false_type {};
+
+template<typename FUNC>
+struct IsDefaultCase<DefaultCaseImpl<FUNC>> : std::true_type {};
+
+template<typename... Cases>
+constexpr size_t CountDefaultCase() {
+  const bool is_default[] = { false, IsDefaultCase<Cases>::value... };
+  size_t default_num = 0;
+  for (bool b : is_default)
+    default_num += b;
+  return default_num;
+}
+
+// the cases are tried in the order start, start + 1, ..., 0, ..., start - 1,
+// the list initializers are evaluated in order and || stops at the first
+// ready case
+template<typename Tuple, size_t... I>
+bool TryCases(Tuple& cases, size_t start, std::index_sequence<I...>) {
+  bool done = false;
+  int first[] = { 0, (done = done || (I >= start && std::get<I>(cases).Try()), 0)... };
+  int second[] = { 0, (done = done || (I < start && std::get<I>(cases).Try()), 0)... };
+  (void)first;
+  (void)second;
+  return done;
+}
+
+template<typename Tuple, typename Slots, size_t... I>
+void WatchCases(Tuple& cases, SelectNode* nodes, Slots& slots, std::index_sequence<I...>) {
+  int dummy[] = { 0, (std::get<I>(cases).Watch(&nodes[I], &std::get<I>(slots)), 0)... };
+  (void)dummy;
+}
+
+template<typename Tuple, typename Slots, size_t... I>
+void FireCase(Tuple& cases, Slots& slots, size_t fired, std::index_sequence<I...>) {
+  int dummy[] = { 0, (I == fired ? (std::get<I>(cases).Fire(&std::get<I>(slots)), 0) : 0)... };
+  (void)dummy;
+}
+
+template<typename Tuple, size_t... I>
+void UnwatchCases(Tuple& cases, SelectNode* nodes, std::index_sequence<I...>) {
+  int dummy[] = { 0, (std::get<I>(cases).Unwatch(&nodes[I]), 0)... };
+  (void)dummy;
+}
+
+inline size_t RandomStart(size_t case_num) {
+  return case_num ? SelectRandom() % case_num : 0;
+}
+
+// the waiter, the nodes and the slots of a blocked FastSelect
+template<typename Tuple, size_t... I>
+struct SelectWaitState {
+  explicit SelectWaitState(CoroutineRef co) : waiter(co) {
+    for (SelectNode& node : nodes)
+      node.waiter = &waiter;
+  }
+
+  SelectWaiter waiter;
+  SelectNode nodes[sizeof...(I)];
+  std::tuple<typename std::decay<typename std::tuple_element<I, Tuple>::type>::type::Slot...> slots;
+};
+
+template<typename Tuple, size_t... I>
+void SelectWait(Tuple& cases, SelectWaitState<Tuple, I...>& state, std::index_sequence<I...> seq) {
+  const size_t case_num = sizeof...(I);
+
+  struct UnwatchGuard {
+    Tuple& cases;
+    SelectNode* nodes;
+    ~UnwatchGuard() {
+      UnwatchCases(cases, nodes, std::index_sequence<I...>());
+    }
+  };
+
+  while (true) {
+    state.waiter.Reset();
+    WatchCases(cases, state.nodes, state.slots, seq);
+    SelectNode* fired = nullptr;
+    {
+      UnwatchGuard guard{cases, state.nodes};
+      if (TryCases(cases, RandomStart(case_num), seq))
+        return;
+      state.waiter.Open();
+      state.waiter.Park();
+      fired = state.waiter.Close();
+    }
+
+    // see Select::BlockingExecute
+    if (fired) {
+      FireCase(cases, state.slots, fired - state.nodes, seq);
+      return;
+    }
+    // another thread may take the value first, then wait again
+    if (TryCases(cases, RandomStart(case_num), seq))
+      return;
+  }
+}
+
+template<typename Tuple, size_t... I>
+void SelectBlocking(Tuple& cases, std::index_sequence<I...> seq) {
+  if (TryCases(cases, RandomStart(sizeof...(I)), seq))
+    return;
+
+  // the stack of a suspended coroutine may be swapped out, so a coroutine
+  // keeps the wait state on the heap, a thread keeps it on its stack
+  CoroutineRef co = CurrentCoroutine();
+  if (co.coroutine) {
+    std::unique_ptr<SelectWaitState<Tuple, I...>> state(new SelectWaitState<Tuple, I...>(co));
+    SelectWait(cases, *state, seq);
+  } else {
+    SelectWaitState<Tuple, I...> state(co);
+    SelectWait(cases, state, seq);
+  }
+}
+
+template<typename Tuple, size_t... I>
+void SelectDispatch(Tuple& cases, std::false_type, std::index_sequence<I...> seq) {
+  SelectBlocking(cases, seq);
+}
+
+template<typename Tuple, size_t... I>
+void SelectDispatch(Tuple& cases, std::true_type, std::index_sequence<I...> seq) {
+  if (!TryCases(cases, RandomStart(sizeof...(I)), seq))
+    std::get<sizeof...(I)>(cases)();
+}
+
+} // namespace internal
+
+
+template<typename T, size_t buffer_size, typename FUNC>
+internal::RecvCaseImpl<T, buffer_size, FUNC> RecvCase(const IChan<T, buffer_size>& ch, FUNC f) {
+  return { internal::ChanAccess::Buffer(ch), std::move(f) };
+}
+
+template<typename T, size_t buffer_size, typename FUNC>
+internal::SendCaseImpl<T, buffer_size, FUNC> SendCase(const OChan<T, buffer_size>& ch, const T& value, FUNC f) {
+  return { internal::ChanAccess::Buffer(ch), value, std::move(f) };
+}
+
+template<typename FUNC>
+internal::DefaultCaseImpl<FUNC> DefaultCase(FUNC f) {
+  return internal::DefaultCaseImpl<FUNC>(std::move(f));
+}
+
+// Select without heap allocation, e.g.
+//   FastSelect(
+//     RecvCase(in, [&](int v) { ... }),
+//     SendCase(out, x, [&]() { ... }),
+//     DefaultCase([&]() { ... }));   // optional, must be the last one
+// The cases live in a tuple on the stack and are called directly, the first
+// case to try is picked by a thread local PRNG. Blocks like Select when
+// there is no DefaultCase. The channels must outlive the call.
+template<typename... Cases>
+void FastSelect(Cases&&... cases) {
+  static_assert(sizeof...(Cases) > 0, "FastSelect needs at least one case");
+
+  typedef std::tuple<typename std::decay<Cases>::type...> CaseTypes;
+  const size_t case_num = sizeof...(Cases);
+  typedef internal::IsDefaultCase<typename std::tuple_element<case_num - 1, CaseTypes>::type> HasDefault;
+
+  static_assert(internal::CountDefaultCase<typename std::decay<Cases>::type...>()
+                == (HasDefault::value ? 1 : 0),
+                "There should be only atmost 1 DefaultCase which must be the last paramter of the FastSelect");
+
+  std::tuple<Cases&...> tuple(cases...);
+  internal::SelectDispatch(tuple, HasDefault(),
+                           std::make_index_sequence<case_num - (HasDefault::value ? 1 : 0)>());
+}
+
 } // namespace zbaselib
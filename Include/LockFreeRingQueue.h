@@ -2,139 +2,468 @@
 
 #include <assert.h>
 #include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <algorithm>
 #include <atomic>
+#include <chrono>
 #include <exception>
+#include <new>
+#include <thread>
+#include <type_traits>
+#include <utility>
+
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+#endif
 
 #define THREAD_SAFE
 
-const static size_t max_queu_size = 1 << 20;
+const static size_t cache_line_size = 64;
+
+// By default the producer side, the consumer side and the read-mostly fields
+// of a queue live on different cache lines. Define ZBASELIB_RING_QUEUE_PACKED
+// to pack them together, benchLockFreeRingQueue uses it to compare layouts.
+#ifdef ZBASELIB_RING_QUEUE_PACKED
+const static size_t ring_queue_pad_size = 1;
+#else
+const static size_t ring_queue_pad_size = cache_line_size;
+#endif
+
+// round n up to the next power of two
+inline size_t RoundUpPowerOfTwo(size_t n) {
+  size_t size = 1;
+  while (size < n)
+    size <<= 1;
+  return size;
+}
+
+// tell the cpu we are in a spin loop
+inline void CpuRelax() {
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_ia32_pause();
+#elif defined(__aarch64__)
+  asm volatile("yield");
+#endif
+}
+
+// Park the calling thread while *word == expected, until it is woken by
+// FutexWake() or the deadline passes. It may also return spuriously.
+// A word in memory shared between processes needs is_shared, the private
+// futex is cheaper but only works inside one process.
+// On other platforms than Linux it just sleeps a little while.
+inline void FutexWait(std::atomic<uint32_t>* word, uint32_t expected,
+                      std::chrono::steady_clock::time_point deadline,
+                      bool is_shared = false) {
+#ifdef __linux__
+  struct timespec timeout;
+  struct timespec* timeout_ptr = nullptr;
+  if (deadline != std::chrono::steady_clock::time_point::max()) {
+    auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+      deadline - std::chrono::steady_clock::now()).count();
+    if (ns <= 0)
+      return;
+    timeout.tv_sec = ns / 1000000000;
+    timeout.tv_nsec = ns % 1000000000;
+    timeout_ptr = &timeout;
+  }
+  syscall(SYS_futex, reinterpret_cast<uint32_t*>(word),
+          is_shared ? FUTEX_WAIT : FUTEX_WAIT_PRIVATE,
+          expected, timeout_ptr, nullptr, 0);
+#else
+  (void)word;
+  (void)expected;
+  (void)deadline;
+  (void)is_shared;
+  std::this_thread::sleep_for(std::chrono::microseconds(100));
+#endif
+}
+
+// wake at most wake_num threads parked on word
+inline void FutexWake(std::atomic<uint32_t>* word, int wake_num, bool is_shared = false) {
+#ifdef __linux__
+  syscall(SYS_futex, reinterpret_cast<uint32_t*>(word),
+          is_shared ? FUTEX_WAKE : FUTEX_WAKE_PRIVATE,
+          wake_num, nullptr, nullptr, 0);
+#else
+  (void)word;
+  (void)wake_num;
+  (void)is_shared;
+#endif
+}
+
+// A queue state change which threads can park on, e.g. "a value is pushed".
+// The waiter count lets the notifier skip the futex syscall when nobody
+// is parked. An event placed in shared memory must be is_shared, its
+// waiters may be in other processes.
+struct RingQueueEvent {
+  std::atomic<uint32_t> seq;      // bumped on every notify with waiters
+  std::atomic<uint32_t> waiters;  // number of parking threads
+  const bool is_shared;
+
+  explicit RingQueueEvent(bool is_shared = false) : seq(0), waiters(0), is_shared(is_shared) {}
+
+  void Notify(int wake_num) {
+    // pairs with the fence in FutexWaitStrategy::Wait(), either the waiter
+    // sees the new queue state, or we see the waiter
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (waiters.load(std::memory_order_relaxed) == 0)
+      return;
+    seq.fetch_add(1, std::memory_order_relaxed);
+    FutexWake(&seq, wake_num, is_shared);
+  }
+};
+
+// Wait strategies of LockFreeRingQueue's PushWait/PopWait, selected by its
+// third template parameter. Wait() retries try_func until it succeeds or the
+// deadline passes, and returns whether it succeeded. need_notify tells the
+// queue whether Push/Pop have to notify the parked threads, it costs a full
+// memory barrier per operation, so only the futex strategy pays for it.
+
+// busy spin, the lowest latency, but the waiting thread keeps a core busy
+struct SpinWaitStrategy {
+  const static bool need_notify = false;
+
+  template<typename TryFunc>
+  static bool Wait(RingQueueEvent&, TryFunc try_func,
+                   std::chrono::steady_clock::time_point deadline) {
+    bool is_timed = deadline != std::chrono::steady_clock::time_point::max();
+    for (uint32_t spin = 1; !try_func(); spin++) {
+      CpuRelax();
+      if (is_timed && spin % 256 == 0 && std::chrono::steady_clock::now() >= deadline)
+        return false;
+    }
+    return true;
+  }
+};
+
+// spin a while, then give up the cpu by sched_yield between every retry
+struct YieldWaitStrategy {
+  const static bool need_notify = false;
+  const static int spin_num = 64;
+
+  template<typename TryFunc>
+  static bool Wait(RingQueueEvent&, TryFunc try_func,
+                   std::chrono::steady_clock::time_point deadline) {
+    bool is_timed = deadline != std::chrono::steady_clock::time_point::max();
+    for (int spin = 0; spin < spin_num; spin++) {
+      if (try_func())
+        return true;
+      CpuRelax();
+    }
+    while (!try_func()) {
+      if (is_timed && std::chrono::steady_clock::now() >= deadline)
+        return false;
+      std::this_thread::yield();
+    }
+    return true;
+  }
+};
+
+// spin a while, then park on a futex until the queue state changes, an idle
+// waiter uses no cpu
+struct FutexWaitStrategy {
+  const static bool need_notify = true;
+  const static int spin_num = 64;
+
+  template<typename TryFunc>
+  static bool Wait(RingQueueEvent& event, TryFunc try_func,
+                   std::chrono::steady_clock::time_point deadline) {
+    for (int spin = 0; spin < spin_num; spin++) {
+      if (try_func())
+        return true;
+      CpuRelax();
+    }
+    while (true) {
+      event.waiters.fetch_add(1, std::memory_order_relaxed);
+      std::atomic_thread_fence(std::memory_order_seq_cst);
+      uint32_t seq = event.seq.load(std::memory_order_relaxed);
+
+      bool is_succeed = try_func();
+      if (is_succeed || std::chrono::steady_clock::now() >= deadline) {
+        event.waiters.fetch_sub(1, std::memory_order_relaxed);
+        return is_succeed;
+      }
+
+      FutexWait(&event.seq, seq, deadline, event.is_shared);
+      event.waiters.fetch_sub(1, std::memory_order_relaxed);
+    }
+  }
+};
+
+// Modes of LockFreeRingQueue, selected by its second template parameter.
+struct RingQueueMPMC {};  // any number of producer and consumer threads
+struct RingQueueSPSC {};  // exactly one producer thread and one consumer thread
+
+// The claim and publish steps of one MPMC Push/Pop, shared by
+// LockFreeRingQueue and ShmRingQueue, which keep their indexes and slots in
+// different places. sequence(pos) returns the sequence number of the slot of
+// pos, see LockFreeRingQueue for its states. A claimed position is owned by
+// the caller until it is published.
+struct RingQueueMPMCSteps {
+  // claim the position to push into, false if the queue is full
+  template<typename SequenceFunc>
+  static bool ClaimPush(std::atomic<uint64_t>& tail_pos, std::atomic<uint64_t>& head_pos,
+                        std::atomic<uint64_t>& cached_head, uint64_t cap,
+                        SequenceFunc sequence, uint64_t* claimed_pos) {
+    uint64_t pos = tail_pos.load(std::memory_order_relaxed);
+    while (true) {
+      if ((int64_t)(pos - cached_head.load(std::memory_order_relaxed)) >= (int64_t)cap) {
+        uint64_t head = head_pos.load(std::memory_order_relaxed);
+        cached_head.store(head, std::memory_order_relaxed);
+        if ((int64_t)(pos - head) >= (int64_t)cap)
+          return false;
+      }
+
+      uint64_t seq = sequence(pos).load(std::memory_order_acquire);
+      int64_t diff = (int64_t)seq - (int64_t)pos;
+
+      if (diff == 0) {
+        // the slot is free, try to claim position pos
+        if (tail_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+          break;
+      } else if (diff < 0) {
+        // the slot still holds the value of last lap, queue is full
+        return false;
+      } else {
+        // other producer has claimed pos, try again
+        pos = tail_pos.load(std::memory_order_relaxed);
+      }
+    }
+    *claimed_pos = pos;
+    return true;
+  }
+
+  // claim the position to pop from, false if the queue is empty
+  template<typename SequenceFunc>
+  static bool ClaimPop(std::atomic<uint64_t>& head_pos, std::atomic<uint64_t>& tail_pos,
+                       std::atomic<uint64_t>& cached_tail,
+                       SequenceFunc sequence, uint64_t* claimed_pos) {
+    uint64_t pos = head_pos.load(std::memory_order_relaxed);
+    while (true) {
+      if ((int64_t)(cached_tail.load(std::memory_order_relaxed) - pos) <= 0) {
+        uint64_t tail = tail_pos.load(std::memory_order_relaxed);
+        cached_tail.store(tail, std::memory_order_relaxed);
+        if ((int64_t)(tail - pos) <= 0)
+          return false;
+      }
+
+      uint64_t seq = sequence(pos).load(std::memory_order_acquire);
+      int64_t diff = (int64_t)seq - (int64_t)(pos + 1);
+
+      if (diff == 0) {
+        // the slot is filled, try to claim position pos
+        if (head_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+          break;
+      } else if (diff < 0) {
+        // the producer of pos has not finished yet, queue is empty
+        return false;
+      } else {
+        // other consumer has claimed pos, try again
+        pos = head_pos.load(std::memory_order_relaxed);
+      }
+    }
+    *claimed_pos = pos;
+    return true;
+  }
+
+  // publish the value written into the slot to the consumer of pos
+  static void PublishPush(std::atomic<uint64_t>& seq, uint64_t pos) {
+    seq.store(pos + 1, std::memory_order_release);
+  }
 
-template<typename T>
+  // give the slot back to the producer of next lap
+  static void PublishPop(std::atomic<uint64_t>& seq, uint64_t pos, uint64_t cap) {
+    seq.store(pos + cap, std::memory_order_release);
+  }
+};
+
+// Bounded MPMC ring queue.
+// Every slot carries its own sequence number, so producers and consumers only
+// synchronize on the slot they claimed, a slow copy in one slot never stalls
+// the threads working on the other slots.
+//
+// Push/Pop never block. PushWait/PopWait and their timed variants wait for
+// the queue to become non-full/non-empty with a pluggable wait strategy,
+// the futex one parks the thread until another thread pops/pushes.
+// The wait strategy is the third template parameter.
+//
+// For the slot of position pos:
+//   sequence == pos           slot is free, the producer of pos can write it
+//   sequence == pos + 1       slot is filled, the consumer of pos can read it
+//   sequence == pos + cap     slot is free again for the producer of next lap
+//
+// Positions are 64-bit counters which never wrap in practice, and the
+// capacity is rounded up to a power of two, so the slot of a position is
+// pos & mask and the capacity is only limited by memory.
+//
+// Producers keep a cached copy of head_pos and consumers a cached copy of
+// tail_pos next to their own index, the full/empty check is done against the
+// cached copy and the other side's cache line is only read when the cached
+// copy says the queue is full/empty.
+//
+// In RingQueueSPSC mode each index has a single writer, so there are no
+// sequence numbers and no CAS: a side publishes its index with a release
+// store and reads the other side's index with an acquire load.
+//
+// Slots are raw storage, a value is constructed in place when pushed and
+// destroyed when popped, so T needs no default constructor and unused
+// capacity costs no construction.
+template<typename T, typename Mode = RingQueueMPMC, typename WaitStrategy = YieldWaitStrategy>
 class LockFreeRingQueue {
 public:
 
   LockFreeRingQueue(size_t queue_size) {
-    assert(queue_size < max_queu_size);
+    assert(queue_size > 0);
+    // RoundUpPowerOfTwo would never return above this
+    assert(queue_size <= (SIZE_MAX >> 1) + 1);
+
+    // with one slot a filled sequence pos + 1 would look free for pos + 1
+    cap = RoundUpPowerOfTwo(std::max<size_t>(queue_size, 2));
+    mask = cap - 1;
 
-    ring_queue = new(std::nothrow) T[queue_size];
+    ring_queue = new(std::nothrow) Storage[cap];
     assert(ring_queue);
 
-    cap = queue_size;
-    
-    
+    sequences = nullptr;
+    if (std::is_same<Mode, RingQueueMPMC>::value) {
+      sequences = new(std::nothrow) std::atomic<uint64_t>[cap];
+      assert(sequences);
+
+      for (size_t i = 0; i < cap; i++)
+        sequences[i].store(i, std::memory_order_relaxed);
+    }
+
+    head_pos.store(0, std::memory_order_relaxed);
+    cached_tail.store(0, std::memory_order_relaxed);
+    tail_pos.store(0, std::memory_order_relaxed);
+    cached_head.store(0, std::memory_order_relaxed);
   }
 
   ~LockFreeRingQueue() {
+    // destroy the values left in the queue
+    uint64_t tail = tail_pos.load(std::memory_order_relaxed);
+    for (uint64_t pos = head_pos.load(std::memory_order_relaxed); pos != tail; pos++)
+      SlotValue(pos)->~T();
+
     delete []ring_queue;
     ring_queue = nullptr;
+    delete []sequences;
+    sequences = nullptr;
   }
 
   LockFreeRingQueue(const LockFreeRingQueue&) = delete;
-  LockFreeRingQueue& operator=(const LockFreeRingQueue&) = delete; 
+  LockFreeRingQueue& operator=(const LockFreeRingQueue&) = delete;
+
 
-  
   THREAD_SAFE size_t GetCap() const {
     return cap;
   }
 
   THREAD_SAFE size_t GetQueueSize() const {
-    uint64_t pos = 0;
-    QueuePos* pos_ptr = (QueuePos*)&pos;
-
-    pos = queue_pos.load(std::memory_order_relaxed);
+    // load head first, head never passes tail, so tail >= head here
+    uint64_t head = head_pos.load(std::memory_order_relaxed);
+    uint64_t tail = tail_pos.load(std::memory_order_relaxed);
 
-    size_t size = 0;
+    size_t size = static_cast<size_t>(tail - head);
+    return size > cap ? cap : size;
+  }
 
-    if (pos_ptr->head_pos <= pos_ptr->tail_pos)
-      size = pos_ptr->tail_pos - pos_ptr->head_pos;
-    else
-      size = (pos_ptr->tail_pos - 0) + (cap - pos_ptr->head_pos);
+  THREAD_SAFE bool Push(const T& value) {
+    return Emplace(value);
+  }
 
-    return size;
+  THREAD_SAFE bool Push(T&& value) {
+    return Emplace(std::move(value));
   }
 
-  THREAD_SAFE bool Push(T value) {
-    while (true) {
-      // use uint64_t but not QueuePos is to avoid call QueuePos's constructor and destructor frequently.
-      uint64_t old_pos = 0;
-      uint64_t new_pos = 0;
-      QueuePos* old_pos_ptr = (QueuePos*)&old_pos;
-      QueuePos* new_pos_ptr = (QueuePos*)&new_pos;
-
-      old_pos = queue_pos.load(std::memory_order_relaxed);
-      new_pos = old_pos;
-
-      if (old_pos_ptr->head_pos == old_pos_ptr->tail_pos && !old_pos_ptr->is_empty)
-	return false;
-
-      if (old_pos_ptr->is_locked)
-	continue;
-
-      ++new_pos_ptr->tail_pos;
-      // lock queue
-      new_pos_ptr->is_locked = 1;
-      new_pos_ptr->is_empty = 0;
-
-      // if we come to the end of the ring, set our 
-      if (new_pos_ptr->tail_pos >= cap)
-	new_pos_ptr->tail_pos -= cap;
-
-      bool is_queue_pos_not_changed = queue_pos.compare_exchange_weak(old_pos, new_pos, std::memory_order_seq_cst);
-      if (is_queue_pos_not_changed) {
-	// set value
-	ring_queue[old_pos_ptr->tail_pos] = value;
-	// todo: do we need a memory barrier here?
-	// unlock queue
-	while (true) {
-	  old_pos = 0;
-	  new_pos = 0;
-	  
-	  old_pos = queue_pos.load(std::memory_order_relaxed);
-	  new_pos = old_pos;
-
-	  new_pos_ptr->is_locked = 0;
-
-	  bool is_free_lock_succeed = queue_pos.compare_exchange_weak(old_pos, new_pos, std::memory_order_seq_cst);
-	  if (is_free_lock_succeed)
-	    break;
-	}
-	break;
-      }      
-    }
+  // construct the value in place with args, args are not touched if the
+  // queue is full
+  template<typename... Args>
+  THREAD_SAFE bool Emplace(Args&&... args) {
+    if (!EmplaceImpl(Mode(), std::forward<Args>(args)...))
+      return false;
+    if (WaitStrategy::need_notify)
+      push_event.Notify(1);
     return true;
   }
 
+  // move the value out into *ret_value and destroy it in the slot
   THREAD_SAFE bool Pop(T* ret_value) {
-    while (true) {
-      uint64_t old_pos = 0;
-      uint64_t new_pos = 0;
-      QueuePos* old_pos_ptr = (QueuePos*)&old_pos;
-      QueuePos* new_pos_ptr = (QueuePos*)&new_pos;
+    if (!PopImpl(Mode(), ret_value))
+      return false;
+    if (WaitStrategy::need_notify)
+      pop_event.Notify(1);
+    return true;
+  }
 
-      old_pos = queue_pos.load(std::memory_order_relaxed);
-      new_pos = old_pos;
+  // Push at most n values, a contiguous range of slots is reserved with one
+  // atomic operation. Return the number of values pushed.
+  THREAD_SAFE size_t PushN(const T* values, size_t n) {
+    if (n == 0)
+      return 0;
+    size_t count = PushNImpl(Mode(), values, n);
+    if (WaitStrategy::need_notify && count > 0)
+      push_event.Notify((int)count);
+    return count;
+  }
 
-      if (old_pos_ptr->is_empty)
-	return false;
+  // Pop at most n values into ret_values, a contiguous range of slots is
+  // claimed with one atomic operation. Return the number of values popped.
+  THREAD_SAFE size_t PopN(T* ret_values, size_t n) {
+    if (n == 0)
+      return 0;
+    size_t count = PopNImpl(Mode(), ret_values, n);
+    if (WaitStrategy::need_notify && count > 0)
+      pop_event.Notify((int)count);
+    return count;
+  }
 
-      if (old_pos_ptr->is_locked)
-	continue;
+  // blocked, wait until the value is pushed
+  THREAD_SAFE void PushWait(const T& value) {
+    PushWaitUntil(value, std::chrono::steady_clock::time_point::max());
+  }
 
-      ++new_pos_ptr->head_pos;
+  THREAD_SAFE void PushWait(T&& value) {
+    PushWaitUntil(std::move(value), std::chrono::steady_clock::time_point::max());
+  }
 
-      if (new_pos_ptr->head_pos >= cap)
-	new_pos_ptr->head_pos -= cap;
+  // blocked, wait until a value is popped
+  THREAD_SAFE void PopWait(T* ret_value) {
+    PopWaitUntil(ret_value, std::chrono::steady_clock::time_point::max());
+  }
 
-      if (new_pos_ptr->head_pos == new_pos_ptr->tail_pos)
-	new_pos_ptr->is_empty = 1;
+  // Timed variants, return false if the queue is still full/empty when the
+  // timeout expires. value is not moved from on timeout.
+  template<typename Rep, typename Period>
+  THREAD_SAFE bool PushWaitFor(const T& value, const std::chrono::duration<Rep, Period>& timeout) {
+    return PushWaitUntil(value, std::chrono::steady_clock::now() + timeout);
+  }
 
-      *ret_value = ring_queue[old_pos_ptr->head_pos];
+  template<typename Rep, typename Period>
+  THREAD_SAFE bool PushWaitFor(T&& value, const std::chrono::duration<Rep, Period>& timeout) {
+    return PushWaitUntil(std::move(value), std::chrono::steady_clock::now() + timeout);
+  }
 
-      bool is_pop_succeed = queue_pos.compare_exchange_weak(old_pos, new_pos, std::memory_order_seq_cst);
-      if (is_pop_succeed)
-	break;
-    }
-    return true;
+  template<typename Rep, typename Period>
+  THREAD_SAFE bool PopWaitFor(T* ret_value, const std::chrono::duration<Rep, Period>& timeout) {
+    return PopWaitUntil(ret_value, std::chrono::steady_clock::now() + timeout);
+  }
+
+  THREAD_SAFE bool PushWaitUntil(const T& value, std::chrono::steady_clock::time_point deadline) {
+    return WaitStrategy::Wait(pop_event, [&]() { return Push(value); }, deadline);
+  }
+
+  THREAD_SAFE bool PushWaitUntil(T&& value, std::chrono::steady_clock::time_point deadline) {
+    // Push() only moves from value when it succeeds
+    return WaitStrategy::Wait(pop_event, [&]() { return Push(std::move(value)); }, deadline);
+  }
+
+  THREAD_SAFE bool PopWaitUntil(T* ret_value, std::chrono::steady_clock::time_point deadline) {
+    return WaitStrategy::Wait(push_event, [&]() { return Pop(ret_value); }, deadline);
   }
 
   // todo: not a good Pop() impliemention, because we don't konw the return
@@ -149,18 +478,236 @@ public:
 
 
 private:
-  size_t cap;
-  T* ring_queue;
-  std::atomic_uint64_t queue_pos;
-
-#pragma pack(8)
-  struct QueuePos {
-    volatile uint64_t head_pos  : 20;
-    volatile uint64_t tail_pos  : 20;
-    volatile uint64_t is_locked :  1;
-    volatile uint64_t is_empty  :  1;
-    volatile uint64_t useless   : 22;
-  };
-#pragma pack()
+  typedef typename std::aligned_storage<sizeof(T), alignof(T)>::type Storage;
+
+  T* SlotValue(uint64_t pos) {
+    return reinterpret_cast<T*>(&ring_queue[pos & mask]);
+  }
+
+  std::atomic<uint64_t>& Sequence(uint64_t pos) {
+    return sequences[pos & mask];
+  }
+
+  template<typename... Args>
+  bool EmplaceImpl(RingQueueMPMC, Args&&... args) {
+    auto sequence = [this](uint64_t pos) -> std::atomic<uint64_t>& { return Sequence(pos); };
+    uint64_t pos;
+    if (!RingQueueMPMCSteps::ClaimPush(tail_pos, head_pos, cached_head, cap, sequence, &pos))
+      return false;
+
+    new (SlotValue(pos)) T(std::forward<Args>(args)...);
+    RingQueueMPMCSteps::PublishPush(Sequence(pos), pos);
+    return true;
+  }
+
+  bool PopImpl(RingQueueMPMC, T* ret_value) {
+    auto sequence = [this](uint64_t pos) -> std::atomic<uint64_t>& { return Sequence(pos); };
+    uint64_t pos;
+    if (!RingQueueMPMCSteps::ClaimPop(head_pos, tail_pos, cached_tail, sequence, &pos))
+      return false;
+
+    *ret_value = std::move(*SlotValue(pos));
+    SlotValue(pos)->~T();
+    RingQueueMPMCSteps::PublishPop(Sequence(pos), pos, cap);
+    return true;
+  }
+
+  size_t PushNImpl(RingQueueMPMC, const T* values, size_t n) {
+    uint64_t pos = tail_pos.load(std::memory_order_relaxed);
+    size_t count = 0;
+    while (true) {
+      uint64_t head = cached_head.load(std::memory_order_relaxed);
+      if ((int64_t)(pos - head) + (int64_t)n > (int64_t)cap) {
+        head = head_pos.load(std::memory_order_relaxed);
+        cached_head.store(head, std::memory_order_relaxed);
+      }
+
+      int64_t free_num = (int64_t)cap - (int64_t)(pos - head);
+      if (free_num <= 0)
+        return 0;
+
+      count = n < (size_t)free_num ? n : (size_t)free_num;
+      if (tail_pos.compare_exchange_weak(pos, pos + count, std::memory_order_relaxed))
+        break;
+    }
+
+    // the consumers of last lap have claimed these slots, but may be still
+    // reading them
+    for (size_t i = 0; i < count; i++)
+      WaitSequence(pos + i, pos + i);
+
+    CopyIn(pos, values, count);
+
+    for (size_t i = 0; i < count; i++)
+      RingQueueMPMCSteps::PublishPush(Sequence(pos + i), pos + i);
+    return count;
+  }
+
+  size_t PopNImpl(RingQueueMPMC, T* ret_values, size_t n) {
+    uint64_t pos = head_pos.load(std::memory_order_relaxed);
+    size_t count = 0;
+    while (true) {
+      uint64_t tail = cached_tail.load(std::memory_order_relaxed);
+      if ((int64_t)(tail - pos) < (int64_t)n) {
+        tail = tail_pos.load(std::memory_order_relaxed);
+        cached_tail.store(tail, std::memory_order_relaxed);
+      }
+
+      int64_t used_num = (int64_t)(tail - pos);
+      if (used_num <= 0)
+        return 0;
+
+      count = n < (size_t)used_num ? n : (size_t)used_num;
+      if (head_pos.compare_exchange_weak(pos, pos + count, std::memory_order_relaxed))
+        break;
+    }
+
+    // the producers have claimed these slots, but may be still writing them
+    for (size_t i = 0; i < count; i++)
+      WaitSequence(pos + i, pos + i + 1);
+
+    CopyOut(pos, ret_values, count);
+
+    for (size_t i = 0; i < count; i++)
+      RingQueueMPMCSteps::PublishPop(Sequence(pos + i), pos + i, cap);
+    return count;
+  }
+
+  template<typename... Args>
+  bool EmplaceImpl(RingQueueSPSC, Args&&... args) {
+    // only this thread writes tail_pos
+    uint64_t pos = tail_pos.load(std::memory_order_relaxed);
+    if (pos - cached_head.load(std::memory_order_relaxed) >= cap) {
+      uint64_t head = head_pos.load(std::memory_order_acquire);
+      cached_head.store(head, std::memory_order_relaxed);
+      if (pos - head >= cap)
+        return false;
+    }
+
+    new (SlotValue(pos)) T(std::forward<Args>(args)...);
+    tail_pos.store(pos + 1, std::memory_order_release);
+    return true;
+  }
+
+  bool PopImpl(RingQueueSPSC, T* ret_value) {
+    // only this thread writes head_pos
+    uint64_t pos = head_pos.load(std::memory_order_relaxed);
+    if (cached_tail.load(std::memory_order_relaxed) == pos) {
+      uint64_t tail = tail_pos.load(std::memory_order_acquire);
+      cached_tail.store(tail, std::memory_order_relaxed);
+      if (tail == pos)
+        return false;
+    }
+
+    *ret_value = std::move(*SlotValue(pos));
+    SlotValue(pos)->~T();
+    head_pos.store(pos + 1, std::memory_order_release);
+    return true;
+  }
+
+  size_t PushNImpl(RingQueueSPSC, const T* values, size_t n) {
+    uint64_t pos = tail_pos.load(std::memory_order_relaxed);
+    uint64_t head = cached_head.load(std::memory_order_relaxed);
+    if (pos - head + n > cap) {
+      head = head_pos.load(std::memory_order_acquire);
+      cached_head.store(head, std::memory_order_relaxed);
+    }
+
+    size_t free_num = cap - (size_t)(pos - head);
+    size_t count = n < free_num ? n : free_num;
+    if (count == 0)
+      return 0;
+
+    CopyIn(pos, values, count);
+    tail_pos.store(pos + count, std::memory_order_release);
+    return count;
+  }
+
+  size_t PopNImpl(RingQueueSPSC, T* ret_values, size_t n) {
+    uint64_t pos = head_pos.load(std::memory_order_relaxed);
+    uint64_t tail = cached_tail.load(std::memory_order_relaxed);
+    if (tail - pos < n) {
+      tail = tail_pos.load(std::memory_order_acquire);
+      cached_tail.store(tail, std::memory_order_relaxed);
+    }
+
+    size_t used_num = (size_t)(tail - pos);
+    size_t count = n < used_num ? n : used_num;
+    if (count == 0)
+      return 0;
+
+    CopyOut(pos, ret_values, count);
+    head_pos.store(pos + count, std::memory_order_release);
+    return count;
+  }
+
+  // wait until the slot of pos has the given sequence number
+  void WaitSequence(uint64_t pos, uint64_t seq) {
+    for (int spin = 0; Sequence(pos).load(std::memory_order_acquire) != seq; spin++) {
+      if (spin >= 64)
+        std::this_thread::yield();
+    }
+  }
+
+  // copy values into the slots of [pos, pos + n)
+  void CopyIn(uint64_t pos, const T* values, size_t n) {
+    CopyIn(pos, values, n, std::is_trivially_copyable<T>());
+  }
+
+  // move the values of [pos, pos + n) out and destroy them in the slots
+  void CopyOut(uint64_t pos, T* ret_values, size_t n) {
+    CopyOut(pos, ret_values, n, std::is_trivially_copyable<T>());
+  }
+
+  // the range may wrap around the end of ring_queue, so trivially copyable
+  // values are copied as at most two pieces
+  void CopyIn(uint64_t pos, const T* values, size_t n, std::true_type) {
+    size_t index = pos & mask;
+    size_t first = n < cap - index ? n : cap - index;
+    memcpy(&ring_queue[index], values, first * sizeof(T));
+    memcpy(&ring_queue[0], values + first, (n - first) * sizeof(T));
+  }
+
+  void CopyIn(uint64_t pos, const T* values, size_t n, std::false_type) {
+    for (size_t i = 0; i < n; i++)
+      new (SlotValue(pos + i)) T(values[i]);
+  }
+
+  void CopyOut(uint64_t pos, T* ret_values, size_t n, std::true_type) {
+    size_t index = pos & mask;
+    size_t first = n < cap - index ? n : cap - index;
+    memcpy(ret_values, &ring_queue[index], first * sizeof(T));
+    memcpy(ret_values + first, &ring_queue[0], (n - first) * sizeof(T));
+  }
+
+  void CopyOut(uint64_t pos, T* ret_values, size_t n, std::false_type) {
+    for (size_t i = 0; i < n; i++) {
+      ret_values[i] = std::move(*SlotValue(pos + i));
+      SlotValue(pos + i)->~T();
+    }
+  }
 
+  char pad0[ring_queue_pad_size];
+
+  // read-mostly
+  size_t cap;                        // always a power of two
+  size_t mask;                       // cap - 1
+  Storage* ring_queue;
+  std::atomic<uint64_t>* sequences;  // sequence number of each slot, MPMC only
+  char pad1[ring_queue_pad_size];
+
+  // consumer side
+  std::atomic<uint64_t> head_pos;    // next position to pop, only increase
+  std::atomic<uint64_t> cached_tail; // last seen tail_pos
+  char pad2[ring_queue_pad_size];
+
+  // producer side
+  std::atomic<uint64_t> tail_pos;    // next position to push, only increase
+  std::atomic<uint64_t> cached_head; // last seen head_pos
+  char pad3[ring_queue_pad_size];
+
+  // parking threads, only written when a thread parks
+  RingQueueEvent push_event;         // consumers wait for a push
+  RingQueueEvent pop_event;          // producers wait for a pop
+  char pad4[ring_queue_pad_size];
 };
@@ -0,0 +1,349 @@
+#pragma once
+
+#include <assert.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <algorithm>
+#include <atomic>
+#include <functional>
+#include <new>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "LockFreeRingQueue.h"
+
+// Unbounded MPMC queue made of linked fixed-size segments.
+//
+// In steady state Push/Pop only do one fetch_add on the index of the current
+// segment and one CAS on the slot, like a ring buffer. When the tail segment
+// is used up, a producer links a new one with a CAS, so the queue grows
+// during bursts without a global lock.
+//
+// A slot goes EMPTY -> WRITING -> FULL -> TAKEN. A consumer which claims a
+// slot whose producer has not come yet marks it EMPTY -> TAKEN and claims
+// another one, the producer then sees its CAS fail and claims another one too.
+//
+// Segments which are consumed are unlinked and retired. They are protected by
+// hazard pointers, once no thread holds one they are recycled through a
+// freelist of free_segment_num segments, so steady state needs no malloc.
+// At most max_thread_num threads can be inside Push/Pop at the same time,
+// more threads wait for a hazard pointer slot.
+template<typename T>
+class LockFreeSegmentQueue {
+public:
+
+  LockFreeSegmentQueue(size_t segment_size = 1024, size_t max_thread_num = 64,
+                       size_t free_segment_num = 16) :
+    segment_size(segment_size),
+    hazard_slot_num(max_thread_num),
+    retire_threshold(max_thread_num * 2),
+    free_segments(free_segment_num) {
+    assert(segment_size > 0 && max_thread_num > 0);
+
+    hazard_slots = new(std::nothrow) HazardSlot[hazard_slot_num];
+    assert(hazard_slots);
+
+    Segment* segment = NewSegment(0);
+    assert(segment);
+    head_segment.store(segment, std::memory_order_relaxed);
+    tail_segment.store(segment, std::memory_order_relaxed);
+  }
+
+  ~LockFreeSegmentQueue() {
+    // destroy the values left in the queue
+    Segment* segment = head_segment.load(std::memory_order_relaxed);
+    while (segment) {
+      Segment* next = segment->next.load(std::memory_order_relaxed);
+      for (size_t i = 0; i < segment_size; i++) {
+        if (segment->slots[i].state.load(std::memory_order_relaxed) == slot_full)
+          segment->slots[i].Value()->~T();
+      }
+      DeleteSegment(segment);
+      segment = next;
+    }
+
+    for (size_t i = 0; i < hazard_slot_num; i++) {
+      for (Segment* retired : hazard_slots[i].retired)
+        DeleteSegment(retired);
+    }
+    delete []hazard_slots;
+    hazard_slots = nullptr;
+
+    while (free_segments.Pop(&segment))
+      DeleteSegment(segment);
+  }
+
+  LockFreeSegmentQueue(const LockFreeSegmentQueue&) = delete;
+  LockFreeSegmentQueue& operator=(const LockFreeSegmentQueue&) = delete;
+
+
+  // approximate while other threads are pushing/popping
+  THREAD_SAFE size_t GetQueueSize() const {
+    HazardGuard guard(this);
+
+    Segment* head = guard.Protect(head_segment);
+    uint64_t pop_pos = head->base + std::min<uint64_t>(
+      head->pop_index.load(std::memory_order_relaxed), segment_size);
+
+    Segment* tail = guard.Protect(tail_segment);
+    uint64_t push_pos = tail->base + std::min<uint64_t>(
+      tail->push_index.load(std::memory_order_relaxed), segment_size);
+
+    return push_pos > pop_pos ? static_cast<size_t>(push_pos - pop_pos) : 0;
+  }
+
+  // only fail when a new segment can not be allocated
+  THREAD_SAFE bool Push(const T& value) {
+    return Emplace(value);
+  }
+
+  THREAD_SAFE bool Push(T&& value) {
+    return Emplace(std::move(value));
+  }
+
+  template<typename... Args>
+  THREAD_SAFE bool Emplace(Args&&... args) {
+    HazardGuard guard(this);
+    while (true) {
+      Segment* tail = guard.Protect(tail_segment);
+      uint64_t index = tail->push_index.fetch_add(1, std::memory_order_relaxed);
+
+      if (index < segment_size) {
+        Slot& slot = tail->slots[index];
+        uint32_t state = slot_empty;
+        if (slot.state.compare_exchange_strong(state, slot_writing, std::memory_order_relaxed)) {
+          new (slot.Value()) T(std::forward<Args>(args)...);
+          slot.state.store(slot_full, std::memory_order_release);
+          return true;
+        }
+        // a consumer has given up this slot, try next one
+        continue;
+      }
+
+      // the segment is used up, link a new one if nobody has done it
+      Segment* next = tail->next.load(std::memory_order_acquire);
+      if (next == nullptr) {
+        Segment* segment = AllocSegment(tail->base + segment_size);
+        if (segment == nullptr)
+          return false;
+
+        if (tail->next.compare_exchange_strong(next, segment, std::memory_order_acq_rel))
+          next = segment;
+        else
+          RecycleSegment(segment);  // never published, no need to retire
+      }
+      tail_segment.compare_exchange_strong(tail, next);
+    }
+  }
+
+  THREAD_SAFE bool Pop(T* ret_value) {
+    HazardGuard guard(this);
+    while (true) {
+      Segment* head = guard.Protect(head_segment);
+      uint64_t index = head->pop_index.load(std::memory_order_relaxed);
+      if (index >= head->push_index.load(std::memory_order_relaxed)
+          && head->next.load(std::memory_order_acquire) == nullptr)
+        return false;
+
+      index = head->pop_index.fetch_add(1, std::memory_order_relaxed);
+      if (index < segment_size) {
+        Slot& slot = head->slots[index];
+        uint32_t state = slot.state.load(std::memory_order_acquire);
+        // the producer of this slot has not come yet, give up the slot
+        if (state == slot_empty
+            && slot.state.compare_exchange_strong(state, slot_taken, std::memory_order_acquire))
+          continue;
+
+        // the producer is writing the slot
+        for (int spin = 0; state != slot_full; spin++) {
+          if (spin >= 64)
+            std::this_thread::yield();
+          else
+            CpuRelax();
+          state = slot.state.load(std::memory_order_acquire);
+        }
+
+        *ret_value = std::move(*slot.Value());
+        slot.Value()->~T();
+        slot.state.store(slot_taken, std::memory_order_relaxed);
+        return true;
+      }
+
+      // the segment is used up, move to next one
+      Segment* next = head->next.load(std::memory_order_acquire);
+      if (next == nullptr)
+        return false;
+
+      // a retired segment must not be reachable from tail_segment either
+      Segment* tail = head;
+      tail_segment.compare_exchange_strong(tail, next);
+      if (head_segment.compare_exchange_strong(head, next))
+        Retire(guard.slot, head);
+    }
+  }
+
+
+private:
+  typedef typename std::aligned_storage<sizeof(T), alignof(T)>::type Storage;
+
+  const static uint32_t slot_empty = 0;
+  const static uint32_t slot_writing = 1;
+  const static uint32_t slot_full = 2;
+  const static uint32_t slot_taken = 3;
+
+  struct Slot {
+    std::atomic<uint32_t> state;
+    Storage value;
+
+    T* Value() {
+      return reinterpret_cast<T*>(&value);
+    }
+  };
+
+  struct Segment {
+    std::atomic<uint64_t> push_index;  // next slot to push, may pass segment_size
+    char pad0[ring_queue_pad_size];
+    std::atomic<uint64_t> pop_index;   // next slot to pop, may pass segment_size
+    char pad1[ring_queue_pad_size];
+    std::atomic<Segment*> next;
+    uint64_t base;                     // queue position of slots[0]
+    Slot* slots;
+  };
+
+  struct HazardSlot {
+    std::atomic<bool> active;          // owned by a thread
+    std::atomic<Segment*> hazard;      // the segment the owner is using
+    std::vector<Segment*> retired;     // only touched by the owner
+    char pad[ring_queue_pad_size];
+
+    HazardSlot() : active(false), hazard(nullptr) {}
+  };
+
+  // owns a hazard slot during one Push/Pop
+  class HazardGuard {
+  public:
+    explicit HazardGuard(const LockFreeSegmentQueue* queue) :
+      slot(queue->AcquireHazardSlot()) {}
+
+    ~HazardGuard() {
+      slot->hazard.store(nullptr, std::memory_order_release);
+      slot->active.store(false, std::memory_order_release);
+    }
+
+    HazardGuard(const HazardGuard&) = delete;
+    HazardGuard& operator=(const HazardGuard&) = delete;
+
+    // load src and keep the segment alive until next Protect() or the end
+    // of the guard
+    Segment* Protect(const std::atomic<Segment*>& src) {
+      Segment* segment = src.load(std::memory_order_relaxed);
+      while (true) {
+        slot->hazard.store(segment, std::memory_order_seq_cst);
+        Segment* again = src.load(std::memory_order_seq_cst);
+        if (again == segment)
+          return segment;
+        segment = again;
+      }
+    }
+
+    HazardSlot* slot;
+  };
+
+  HazardSlot* AcquireHazardSlot() const {
+    // threads start from different slots, so they seldom race for one
+    static thread_local size_t hint = std::hash<std::thread::id>()(std::this_thread::get_id());
+    for (size_t i = 0; ; i++) {
+      HazardSlot& slot = hazard_slots[(hint + i) % hazard_slot_num];
+      if (!slot.active.load(std::memory_order_relaxed)
+          && !slot.active.exchange(true, std::memory_order_acquire))
+        return &slot;
+      if (i > 0 && i % hazard_slot_num == 0)
+        std::this_thread::yield();
+    }
+  }
+
+  void Retire(HazardSlot* slot, Segment* segment) {
+    slot->retired.push_back(segment);
+    if (slot->retired.size() < retire_threshold)
+      return;
+
+    // recycle the retired segments which no hazard pointer points to
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    std::vector<Segment*> hazards;
+    hazards.reserve(hazard_slot_num);
+    for (size_t i = 0; i < hazard_slot_num; i++) {
+      Segment* hazard = hazard_slots[i].hazard.load(std::memory_order_seq_cst);
+      if (hazard)
+        hazards.push_back(hazard);
+    }
+    std::sort(hazards.begin(), hazards.end());
+
+    size_t keep_num = 0;
+    for (Segment* retired : slot->retired) {
+      if (std::binary_search(hazards.begin(), hazards.end(), retired))
+        slot->retired[keep_num++] = retired;
+      else
+        RecycleSegment(retired);
+    }
+    slot->retired.resize(keep_num);
+  }
+
+  Segment* NewSegment(uint64_t base) {
+    Segment* segment = new(std::nothrow) Segment;
+    if (segment == nullptr)
+      return nullptr;
+
+    segment->slots = new(std::nothrow) Slot[segment_size];
+    if (segment->slots == nullptr) {
+      delete segment;
+      return nullptr;
+    }
+
+    ResetSegment(segment, base);
+    return segment;
+  }
+
+  void DeleteSegment(Segment* segment) {
+    delete []segment->slots;
+    delete segment;
+  }
+
+  void ResetSegment(Segment* segment, uint64_t base) {
+    segment->push_index.store(0, std::memory_order_relaxed);
+    segment->pop_index.store(0, std::memory_order_relaxed);
+    segment->next.store(nullptr, std::memory_order_relaxed);
+    segment->base = base;
+    for (size_t i = 0; i < segment_size; i++)
+      segment->slots[i].state.store(slot_empty, std::memory_order_relaxed);
+  }
+
+  // the segment is published by the CAS on next, which orders the reset
+  Segment* AllocSegment(uint64_t base) {
+    Segment* segment = nullptr;
+    if (!free_segments.Pop(&segment))
+      return NewSegment(base);
+
+    ResetSegment(segment, base);
+    return segment;
+  }
+
+  void RecycleSegment(Segment* segment) {
+    if (!free_segments.Push(segment))
+      DeleteSegment(segment);
+  }
+
+  const size_t segment_size;
+  const size_t hazard_slot_num;
+  const size_t retire_threshold;
+  HazardSlot* hazard_slots;
+  LockFreeRingQueue<Segment*> free_segments;
+  char pad0[ring_queue_pad_size];
+
+  std::atomic<Segment*> head_segment;
+  char pad1[ring_queue_pad_size];
+
+  std::atomic<Segment*> tail_segment;
+  char pad2[ring_queue_pad_size];
+};
@@ -0,0 +1,364 @@
+#pragma once
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <new>
+#include <string>
+#include <type_traits>
+
+#include "LockFreeRingQueue.h"
+
+// Bounded MPMC ring queue in POSIX shared memory, processes which open the
+// same name exchange values through it without copying them into a pipe.
+//
+// The region starts with a header which describes the queue, the slot
+// sequences and the values follow it. The header only stores offsets from
+// the start of the region, every process maps the region at its own address.
+// The algorithm is the MPMC one of LockFreeRingQueue, both queues run the
+// steps of RingQueueMPMCSteps.
+//
+// The first process which opens a name creates and initializes the region,
+// the later ones attach to it and check the magic, the version and the
+// layout of the header. Create and attach are serialized by an fcntl lock on
+// /tmp/<name>.lock like ProcessLock, so an attacher never sees a half
+// initialized header. A region whose creator died before finishing is
+// initialized again by the next process.
+//
+// The values are copied between processes byte by byte, so T must be
+// trivially copyable and must not hold pointers. A process which dies in
+// the middle of Push/Pop leaves its slot claimed forever.
+//
+// Linux only, the futex wait strategy uses shared futexes.
+template<typename T, typename WaitStrategy = YieldWaitStrategy>
+class ShmRingQueue {
+public:
+  static_assert(std::is_trivially_copyable<T>::value,
+                "ShmRingQueue copies values between processes, T must be trivially copyable");
+
+  ShmRingQueue() : header(nullptr), region_size(0), is_creator(false) {}
+
+  ~ShmRingQueue() {
+    Close();
+  }
+
+  ShmRingQueue(const ShmRingQueue&) = delete;
+  ShmRingQueue& operator=(const ShmRingQueue&) = delete;
+
+  // Create the queue of name, e.g. "/collector", or attach to it if another
+  // process has created it. An attacher may give queue_size 0 to accept the
+  // capacity of the creator.
+  bool Open(const char* name, size_t queue_size) {
+    assert(header == nullptr);
+    assert(name && name[0] == '/' && strchr(name + 1, '/') == nullptr);
+
+    std::string lock_file = std::string("/tmp") + name + ".lock";
+    int lock_fd = open(lock_file.c_str(), O_RDWR | O_CREAT, 0600);
+    if (lock_fd == -1) {
+      printf("ShmRingQueue::Open() failed. open() lock file failed: %s\n", strerror(errno));
+      return false;
+    }
+    if (!SetLock(lock_fd, F_WRLCK)) {
+      close(lock_fd);
+      return false;
+    }
+
+    bool result = false;
+    int fd = shm_open(name, O_RDWR | O_CREAT, 0600);
+    if (fd == -1) {
+      printf("ShmRingQueue::Open() failed. shm_open() failed: %s\n", strerror(errno));
+    } else {
+      result = Attach(fd, queue_size) || Create(fd, queue_size);
+      close(fd);
+    }
+
+    SetLock(lock_fd, F_UNLCK);
+    close(lock_fd);
+    return result;
+  }
+
+  // unmap the region, the queue lives on until Unlink()
+  void Close() {
+    if (header == nullptr)
+      return;
+    munmap(header, region_size);
+    header = nullptr;
+    region_size = 0;
+    is_creator = false;
+  }
+
+  // remove the queue of name, the processes which have mapped it keep
+  // using it until they close it. The lock file is left in place like
+  // ProcessLock does, an Open() holding the lock on a removed lock file
+  // would not exclude the next Open().
+  static bool Unlink(const char* name) {
+    return shm_unlink(name) == 0;
+  }
+
+  // true if this process has created the region
+  bool IsCreator() const {
+    return is_creator;
+  }
+
+  THREAD_SAFE size_t GetCap() const {
+    return static_cast<size_t>(header->cap);
+  }
+
+  THREAD_SAFE size_t GetQueueSize() const {
+    uint64_t head = header->head_pos.load(std::memory_order_relaxed);
+    uint64_t tail = header->tail_pos.load(std::memory_order_relaxed);
+    size_t size = static_cast<size_t>(tail - head);
+    return size > header->cap ? static_cast<size_t>(header->cap) : size;
+  }
+
+  THREAD_SAFE bool Push(const T& value) {
+    auto sequence = [this](uint64_t pos) -> std::atomic<uint64_t>& { return Sequence(pos); };
+    uint64_t pos;
+    if (!RingQueueMPMCSteps::ClaimPush(header->tail_pos, header->head_pos, header->cached_head,
+                                       header->cap, sequence, &pos))
+      return false;
+
+    memcpy(SlotValue(pos), &value, sizeof(T));
+    RingQueueMPMCSteps::PublishPush(Sequence(pos), pos);
+    if (WaitStrategy::need_notify)
+      header->push_event.Notify(1);
+    return true;
+  }
+
+  THREAD_SAFE bool Pop(T* ret_value) {
+    auto sequence = [this](uint64_t pos) -> std::atomic<uint64_t>& { return Sequence(pos); };
+    uint64_t pos;
+    if (!RingQueueMPMCSteps::ClaimPop(header->head_pos, header->tail_pos, header->cached_tail,
+                                      sequence, &pos))
+      return false;
+
+    memcpy(ret_value, SlotValue(pos), sizeof(T));
+    RingQueueMPMCSteps::PublishPop(Sequence(pos), pos, header->cap);
+    if (WaitStrategy::need_notify)
+      header->pop_event.Notify(1);
+    return true;
+  }
+
+  // blocked, wait until the value is pushed
+  THREAD_SAFE void PushWait(const T& value) {
+    PushWaitUntil(value, std::chrono::steady_clock::time_point::max());
+  }
+
+  // blocked, wait until a value is popped
+  THREAD_SAFE void PopWait(T* ret_value) {
+    PopWaitUntil(ret_value, std::chrono::steady_clock::time_point::max());
+  }
+
+  // Timed variants, return false if the queue is still full/empty when the
+  // timeout expires.
+  template<typename Rep, typename Period>
+  THREAD_SAFE bool PushWaitFor(const T& value, const std::chrono::duration<Rep, Period>& timeout) {
+    return PushWaitUntil(value, std::chrono::steady_clock::now() + timeout);
+  }
+
+  template<typename Rep, typename Period>
+  THREAD_SAFE bool PopWaitFor(T* ret_value, const std::chrono::duration<Rep, Period>& timeout) {
+    return PopWaitUntil(ret_value, std::chrono::steady_clock::now() + timeout);
+  }
+
+  THREAD_SAFE bool PushWaitUntil(const T& value, std::chrono::steady_clock::time_point deadline) {
+    return WaitStrategy::Wait(header->pop_event, [&]() { return Push(value); }, deadline);
+  }
+
+  THREAD_SAFE bool PopWaitUntil(T* ret_value, std::chrono::steady_clock::time_point deadline) {
+    return WaitStrategy::Wait(header->push_event, [&]() { return Pop(ret_value); }, deadline);
+  }
+
+
+private:
+  const static uint64_t shm_ring_queue_magic = 0x7a62736872696e67;  // "zbshring"
+  const static uint32_t shm_ring_queue_version = 1;
+
+  // The layout is shared by every process which maps the region, so the
+  // padding does not follow ZBASELIB_RING_QUEUE_PACKED.
+  struct Header {
+    explicit Header(uint64_t cap) :
+      magic(0),
+      version(shm_ring_queue_version),
+      header_size(sizeof(Header)),
+      value_size(sizeof(T)),
+      value_align(alignof(T)),
+      cap(cap),
+      sequences_offset(AlignUp(sizeof(Header), cache_line_size)),
+      values_offset(AlignUp(sequences_offset + cap * sizeof(std::atomic<uint64_t>), cache_line_size)),
+      region_size(values_offset + cap * sizeof(T)),
+      head_pos(0),
+      cached_tail(0),
+      tail_pos(0),
+      cached_head(0),
+      push_event(true),
+      pop_event(true) {}
+
+    // read-only once initialized
+    std::atomic<uint64_t> magic;       // shm_ring_queue_magic after the header is initialized
+    uint32_t version;
+    uint32_t header_size;
+    uint32_t value_size;
+    uint32_t value_align;
+    uint64_t cap;                      // always a power of two
+    uint64_t sequences_offset;         // offsets from the start of the region
+    uint64_t values_offset;
+    uint64_t region_size;
+    char pad0[cache_line_size];
+
+    // consumer side
+    std::atomic<uint64_t> head_pos;
+    std::atomic<uint64_t> cached_tail;
+    char pad1[cache_line_size];
+
+    // producer side
+    std::atomic<uint64_t> tail_pos;
+    std::atomic<uint64_t> cached_head;
+    char pad2[cache_line_size];
+
+    RingQueueEvent push_event;         // consumers wait for a push
+    RingQueueEvent pop_event;          // producers wait for a pop
+    char pad3[cache_line_size];
+  };
+
+  static_assert(alignof(T) <= cache_line_size, "the values are aligned to cache lines");
+
+  static uint64_t AlignUp(uint64_t n, uint64_t align) {
+    return (n + align - 1) / align * align;
+  }
+
+  char* Region() const {
+    return reinterpret_cast<char*>(header);
+  }
+
+  std::atomic<uint64_t>& Sequence(uint64_t pos) {
+    std::atomic<uint64_t>* sequences =
+      reinterpret_cast<std::atomic<uint64_t>*>(Region() + header->sequences_offset);
+    return sequences[pos & (header->cap - 1)];
+  }
+
+  T* SlotValue(uint64_t pos) {
+    T* values = reinterpret_cast<T*>(Region() + header->values_offset);
+    return &values[pos & (header->cap - 1)];
+  }
+
+  static bool SetLock(int fd, short type) {
+    struct flock file_lock;
+    memset(&file_lock, 0, sizeof(file_lock));
+    file_lock.l_type = type;
+    file_lock.l_whence = SEEK_SET;
+    file_lock.l_start = 0;
+    file_lock.l_len = 0;
+
+    while (fcntl(fd, F_SETLKW, &file_lock) == -1) {
+      if (errno != EINTR) {
+        printf("ShmRingQueue::Open() failed. fcntl() failed: %s\n", strerror(errno));
+        return false;
+      }
+    }
+    return true;
+  }
+
+  // map an initialized region, false if the region is new or its creator
+  // died before finishing, then it should be created again
+  bool Attach(int fd, size_t queue_size) {
+    struct stat st;
+    if (fstat(fd, &st) == -1 || (size_t)st.st_size < sizeof(Header))
+      return false;
+
+    void* addr = mmap(nullptr, sizeof(Header), PROT_READ, MAP_SHARED, fd, 0);
+    if (addr == MAP_FAILED)
+      return false;
+    const Header* old = static_cast<const Header*>(addr);
+
+    bool is_initialized = old->magic.load(std::memory_order_acquire) == shm_ring_queue_magic;
+    bool is_compatible = is_initialized
+      && old->version == shm_ring_queue_version
+      && old->header_size == sizeof(Header)
+      && old->value_size == sizeof(T)
+      && old->value_align == alignof(T)
+      && (queue_size == 0 || old->cap == RoundUpPowerOfTwo(std::max<size_t>(queue_size, 2)))
+      && old->region_size <= (uint64_t)st.st_size;
+    size_t size = static_cast<size_t>(old->region_size);
+    munmap(addr, sizeof(Header));
+
+    if (!is_initialized)
+      return false;
+    if (!is_compatible) {
+      // a queue of another layout, do not overwrite it
+      printf("ShmRingQueue::Open() failed. the queue is created with another layout\n");
+      return false;
+    }
+
+    addr = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (addr == MAP_FAILED) {
+      printf("ShmRingQueue::Open() failed. mmap() failed: %s\n", strerror(errno));
+      return false;
+    }
+    header = static_cast<Header*>(addr);
+    region_size = size;
+    is_creator = false;
+    return true;
+  }
+
+  bool Create(int fd, size_t queue_size) {
+    if (queue_size == 0) {
+      printf("ShmRingQueue::Open() failed. queue_size is 0 and no queue to attach\n");
+      return false;
+    }
+
+    // a region of another layout is never overwritten, see Attach()
+    struct stat st;
+    if (fstat(fd, &st) == -1)
+      return false;
+    if ((size_t)st.st_size >= sizeof(Header)) {
+      void* addr = mmap(nullptr, sizeof(Header), PROT_READ, MAP_SHARED, fd, 0);
+      if (addr == MAP_FAILED)
+        return false;
+      bool is_initialized = static_cast<const Header*>(addr)->magic.load(std::memory_order_acquire)
+        == shm_ring_queue_magic;
+      munmap(addr, sizeof(Header));
+      if (is_initialized)
+        return false;
+    }
+
+    // with one slot a filled sequence pos + 1 would look free for pos + 1
+    uint64_t cap = RoundUpPowerOfTwo(std::max<size_t>(queue_size, 2));
+    Header layout(cap);
+    size_t size = static_cast<size_t>(layout.region_size);
+    if (ftruncate(fd, 0) == -1 || ftruncate(fd, size) == -1) {
+      printf("ShmRingQueue::Open() failed. ftruncate() failed: %s\n", strerror(errno));
+      return false;
+    }
+
+    void* addr = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (addr == MAP_FAILED) {
+      printf("ShmRingQueue::Open() failed. mmap() failed: %s\n", strerror(errno));
+      return false;
+    }
+
+    header = new (addr) Header(cap);
+    for (uint64_t i = 0; i < cap; i++)
+      new (&Sequence(i)) std::atomic<uint64_t>(i);
+    // the last store, an attacher only trusts a header with the magic
+    header->magic.store(shm_ring_queue_magic, std::memory_order_release);
+
+    region_size = size;
+    is_creator = true;
+    return true;
+  }
+
+  Header* header;      // the start of the mapped region
+  size_t region_size;
+  bool is_creator;
+};
@@ -0,0 +1,202 @@
+// Hashed timing wheel.
+//
+// All the timers of a process share one wheel and one thread, so a timer
+// costs a list node instead of a thread. A timer which expires at tick t is
+// put in slot t % slot_num. The wheel thread sleeps until the earliest
+// expire tick of the pending timers and skips the empty ticks before it, so
+// a long timer costs one wakeup, and it sleeps without timeout when there
+// is no timer.
+//
+// Callbacks run on the wheel thread, they must be short and must not block.
+
+#pragma once
+
+#include <assert.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <list>
+#include <mutex>
+#include <set>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+
+namespace zbaselib {
+
+class TimerWheel {
+public:
+  typedef std::chrono::steady_clock Clock;
+  typedef uint64_t TimerId;
+
+  explicit TimerWheel(std::chrono::milliseconds tick = std::chrono::milliseconds(1),
+                      size_t slot_num = 512) :
+    tick(tick),
+    start(Clock::now()),
+    slots(slot_num),
+    current_tick(0),
+    next_id(1),
+    is_running(true) {
+    assert(tick.count() > 0 && slot_num > 0);
+    worker = std::thread([this]() { Run(); });
+  }
+
+  ~TimerWheel() {
+    {
+      std::lock_guard<std::mutex> ulock(lock);
+      is_running = false;
+    }
+    cond.notify_one();
+    worker.join();
+  }
+
+  TimerWheel(const TimerWheel&) = delete;
+  TimerWheel& operator=(const TimerWheel&) = delete;
+
+  // call callback on the wheel thread at when, rounded up to the next tick
+  TimerId AddTimer(Clock::time_point when, std::function<void()> callback) {
+    std::unique_lock<std::mutex> ulock(lock);
+    TimerId id = next_id++;
+
+    // the wheel thread does not tick while there is no timer
+    if (timers.empty())
+      current_tick = std::max(current_tick, ElapsedTicks(Clock::now()));
+
+    uint64_t expire_tick = TickOf(when);
+    // a timer which has expired fires on the next tick
+    if (expire_tick <= current_tick)
+      expire_tick = current_tick + 1;
+
+    // the wheel thread sleeps until the earliest timer, or without timeout
+    // when there is no timer
+    bool need_wake = expire_ticks.empty() || expire_tick < *expire_ticks.begin();
+
+    std::list<Timer>& slot = slots[expire_tick % slots.size()];
+    slot.push_back(Timer{id, expire_tick, std::move(callback)});
+    timers[id] = Location{&slot, std::prev(slot.end()), expire_ticks.insert(expire_tick)};
+
+    ulock.unlock();
+    if (need_wake)
+      cond.notify_one();
+    return id;
+  }
+
+  template<typename Rep, typename Period>
+  TimerId AddTimer(std::chrono::duration<Rep, Period> delay, std::function<void()> callback) {
+    return AddTimer(Clock::now() + std::chrono::duration_cast<Clock::duration>(delay),
+                    std::move(callback));
+  }
+
+  // return false if the timer has fired or been cancelled
+  bool CancelTimer(TimerId id) {
+    std::lock_guard<std::mutex> ulock(lock);
+    auto iter = timers.find(id);
+    if (iter == timers.end())
+      return false;
+    iter->second.slot->erase(iter->second.iter);
+    expire_ticks.erase(iter->second.tick_iter);
+    timers.erase(iter);
+    return true;
+  }
+
+  size_t GetTimerNum() {
+    std::lock_guard<std::mutex> ulock(lock);
+    return timers.size();
+  }
+
+private:
+  struct Timer {
+    TimerId id;
+    uint64_t expire_tick;
+    std::function<void()> callback;
+  };
+
+  struct Location {
+    std::list<Timer>* slot;
+    std::list<Timer>::iterator iter;
+    std::multiset<uint64_t>::iterator tick_iter;
+  };
+
+  // the first tick at or after when
+  uint64_t TickOf(Clock::time_point when) const {
+    if (when <= start)
+      return 0;
+    return static_cast<uint64_t>((when - start + tick - Clock::duration(1)) / tick);
+  }
+
+  // the number of ticks which are over at now
+  uint64_t ElapsedTicks(Clock::time_point now) const {
+    if (now <= start)
+      return 0;
+    return static_cast<uint64_t>((now - start) / tick);
+  }
+
+  void Run() {
+    std::vector<std::function<void()>> expired;
+    std::unique_lock<std::mutex> ulock(lock);
+    while (is_running) {
+      if (timers.empty()) {
+        cond.wait(ulock);
+        continue;
+      }
+
+      // no timer expires before the earliest one, skip the empty ticks
+      uint64_t now_tick = ElapsedTicks(Clock::now());
+      uint64_t earliest_tick = *expire_ticks.begin();
+      current_tick = std::max(current_tick, std::min(now_tick, earliest_tick - 1));
+      while (current_tick < now_tick) {
+        current_tick++;
+        std::list<Timer>& slot = slots[current_tick % slots.size()];
+        for (auto iter = slot.begin(); iter != slot.end(); ) {
+          if (iter->expire_tick > current_tick) {
+            ++iter;
+            continue;
+          }
+          auto timer = timers.find(iter->id);
+          expire_ticks.erase(timer->second.tick_iter);
+          timers.erase(timer);
+          expired.push_back(std::move(iter->callback));
+          iter = slot.erase(iter);
+        }
+      }
+
+      if (!expired.empty()) {
+        ulock.unlock();
+        for (auto& callback : expired)
+          callback();
+        expired.clear();
+        ulock.lock();
+        continue;
+      }
+
+      if (!expire_ticks.empty())
+        cond.wait_until(ulock, start + tick * *expire_ticks.begin());
+    }
+  }
+
+  const Clock::duration tick;
+  const Clock::time_point start;
+
+  std::mutex lock;
+  std::condition_variable cond;
+  std::vector<std::list<Timer>> slots;
+  std::unordered_map<TimerId, Location> timers;
+  std::multiset<uint64_t> expire_ticks;  // of the pending timers, the first is the earliest
+  uint64_t current_tick;       // the ticks up to current_tick have fired
+  TimerId next_id;
+  bool is_running;
+  std::thread worker;
+};
+
+// one wheel for the whole process
+inline TimerWheel& GetTimerWheel() {
+  static TimerWheel wheel;
+  return wheel;
+}
+
+} // namespace zbaselib
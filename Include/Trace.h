@@ -0,0 +1,138 @@
+// Zero cost tracing.
+//
+// ZBASELIB_TRACE(subsystem, level, fmt, ...) compiles to nothing unless the
+// trace level of the subsystem, the macro ZBASELIB_TRACE_<subsystem>, is
+// at least level. Defining ZBASELIB_DEBUG sets every subsystem whose level
+// is not given to ZBASELIB_TRACE_VERBOSE, e.g.
+//   -DZBASELIB_DEBUG                                   trace everything
+//   -DZBASELIB_TRACE_CHANNEL=1                         only Channel, info level
+//
+// An enabled trace point formats its message with snprintf into a lock-free
+// in-memory ring buffer instead of writing to stdout, the last
+// trace_ring_size messages can be dumped on demand with DumpTrace().
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <thread>
+
+#define ZBASELIB_TRACE_OFF      0
+#define ZBASELIB_TRACE_INFO     1
+#define ZBASELIB_TRACE_VERBOSE  2
+
+#ifdef ZBASELIB_DEBUG
+#define ZBASELIB_TRACE_DEFAULT  ZBASELIB_TRACE_VERBOSE
+#else
+#define ZBASELIB_TRACE_DEFAULT  ZBASELIB_TRACE_OFF
+#endif
+
+// trace level of each subsystem
+#ifndef ZBASELIB_TRACE_CHANNEL
+#define ZBASELIB_TRACE_CHANNEL  ZBASELIB_TRACE_DEFAULT
+#endif
+
+#define ZBASELIB_TRACE(subsystem, level, ...)                            \
+  do {                                                                   \
+    if (ZBASELIB_TRACE_##subsystem >= (level))                           \
+      ::zbaselib::GetTraceRing().Write(#subsystem, __VA_ARGS__);         \
+  } while (0)
+
+
+namespace zbaselib {
+
+const static size_t trace_ring_size = 4096;  // must be a power of two
+const static size_t trace_message_size = 96;
+
+class TraceRing {
+public:
+  TraceRing() : write_pos(0) {
+    for (size_t i = 0; i < trace_ring_size; i++)
+      records[i].seq.store(0, std::memory_order_relaxed);
+  }
+
+  TraceRing(const TraceRing&) = delete;
+  TraceRing& operator=(const TraceRing&) = delete;
+
+#if defined(__GNUC__)
+  __attribute__((format(printf, 3, 4)))
+#endif
+  void Write(const char* subsystem, const char* fmt, ...) {
+    uint64_t pos = write_pos.fetch_add(1, std::memory_order_relaxed);
+    Record& record = records[pos & (trace_ring_size - 1)];
+
+    // odd seq means the record is being written
+    record.seq.store(pos * 2 + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+
+    record.time_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+      std::chrono::steady_clock::now().time_since_epoch()).count();
+    record.thread_id = std::hash<std::thread::id>()(std::this_thread::get_id());
+    record.subsystem = subsystem;
+
+    va_list args;
+    va_start(args, fmt);
+    vsnprintf(record.message, trace_message_size, fmt, args);
+    va_end(args);
+
+    record.seq.store(pos * 2 + 2, std::memory_order_release);
+  }
+
+  // print the buffered messages, oldest first, messages which are being
+  // overwritten while dumping are skipped
+  void Dump(FILE* fp) {
+    uint64_t end = write_pos.load(std::memory_order_acquire);
+    uint64_t begin = end > trace_ring_size ? end - trace_ring_size : 0;
+
+    for (uint64_t pos = begin; pos < end; pos++) {
+      Record& record = records[pos & (trace_ring_size - 1)];
+      if (record.seq.load(std::memory_order_acquire) != pos * 2 + 2)
+        continue;
+
+      Record copy;
+      copy.time_ns = record.time_ns;
+      copy.thread_id = record.thread_id;
+      copy.subsystem = record.subsystem;
+      memcpy(copy.message, record.message, trace_message_size);
+      copy.message[trace_message_size - 1] = '\0';
+
+      std::atomic_thread_fence(std::memory_order_acquire);
+      if (record.seq.load(std::memory_order_relaxed) != pos * 2 + 2)
+        continue;
+
+      fprintf(fp, "%lld [%zx] %s: %s\n", (long long)copy.time_ns,
+              copy.thread_id, copy.subsystem, copy.message);
+    }
+    fflush(fp);
+  }
+
+private:
+  struct Record {
+    std::atomic<uint64_t> seq;  // pos * 2 + 2 when the record of pos is written
+    int64_t time_ns;
+    size_t thread_id;
+    const char* subsystem;
+    char message[trace_message_size];
+  };
+
+  std::atomic<uint64_t> write_pos;
+  Record records[trace_ring_size];
+};
+
+// one ring for the whole process
+inline TraceRing& GetTraceRing() {
+  static TraceRing ring;
+  return ring;
+}
+
+inline void DumpTrace(FILE* fp = stderr) {
+  GetTraceRing().Dump(fp);
+}
+
+} // namespace zbaselib
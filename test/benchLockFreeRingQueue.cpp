@@ -0,0 +1,110 @@
+// Throughput of LockFreeRingQueue with different producer/consumer numbers.
+//
+// This file is built twice, benchLockFreeRingQueue uses the padded layout and
+// benchLockFreeRingQueuePacked defines ZBASELIB_RING_QUEUE_PACKED. Run both on
+// a multi-core machine to compare, e.g.
+//   perf stat -e cache-misses,cache-references ./benchLockFreeRingQueue
+//   perf stat -e cache-misses,cache-references ./benchLockFreeRingQueuePacked
+
+#include <stdint.h>
+#include <thread>
+#include <vector>
+#include <iostream>
+#include <chrono>
+#include <algorithm>
+
+#include "LockFreeRingQueue.h"
+
+
+const size_t queue_size = 1024;
+const uint64_t total_num = 10000000;
+
+template<typename Mode>
+void bench(const char* name, int thread_num) {
+  LockFreeRingQueue<uint64_t, Mode> lf_queue(queue_size);
+  const uint64_t num = total_num / thread_num;
+  std::vector<std::thread> threads;
+
+  auto begin = std::chrono::steady_clock::now();
+
+  for (int i = 0; i < thread_num; i++) {
+    threads.emplace_back([&lf_queue, num]() {
+      for (uint64_t j = 0; j < num; j++) {
+        while (lf_queue.Push(j) == false)
+          std::this_thread::yield();
+      }
+    });
+  }
+
+  for (int i = 0; i < thread_num; i++) {
+    threads.emplace_back([&lf_queue, num]() {
+      uint64_t tmp;
+      for (uint64_t j = 0; j < num; j++) {
+        while (lf_queue.Pop(&tmp) == false)
+          std::this_thread::yield();
+      }
+    });
+  }
+
+  for (auto& t : threads)
+    t.join();
+
+  auto end = std::chrono::steady_clock::now();
+  double seconds = std::chrono::duration<double>(end - begin).count();
+  std::cout << name << " " << thread_num << "P" << thread_num << "C  "
+            << (num * thread_num) / seconds / 1e6 << " Mops/s" << std::endl;
+}
+
+template<typename Mode>
+void benchBatch(const char* name, size_t batch_size) {
+  LockFreeRingQueue<uint64_t, Mode> lf_queue(queue_size);
+
+  auto begin = std::chrono::steady_clock::now();
+
+  std::thread producer([&lf_queue, batch_size]() {
+    std::vector<uint64_t> values(batch_size, 42);
+    for (uint64_t j = 0; j < total_num; ) {
+      size_t n = lf_queue.PushN(values.data(), std::min<uint64_t>(batch_size, total_num - j));
+      if (n == 0)
+        std::this_thread::yield();
+      j += n;
+    }
+  });
+
+  std::thread consumer([&lf_queue, batch_size]() {
+    std::vector<uint64_t> values(batch_size);
+    for (uint64_t j = 0; j < total_num; ) {
+      size_t n = lf_queue.PopN(values.data(), batch_size);
+      if (n == 0)
+        std::this_thread::yield();
+      j += n;
+    }
+  });
+
+  producer.join();
+  consumer.join();
+
+  auto end = std::chrono::steady_clock::now();
+  double seconds = std::chrono::duration<double>(end - begin).count();
+  std::cout << name << " 1P1C batch " << batch_size << "  "
+            << total_num / seconds / 1e6 << " Mops/s" << std::endl;
+}
+
+
+int main() {
+#ifdef ZBASELIB_RING_QUEUE_PACKED
+  std::cout << "layout: packed";
+#else
+  std::cout << "layout: padded";
+#endif
+  std::cout << "  sizeof(LockFreeRingQueue): " << sizeof(LockFreeRingQueue<uint64_t>) << std::endl;
+
+  for (int thread_num = 1; thread_num <= 4; thread_num *= 2)
+    bench<RingQueueMPMC>("MPMC", thread_num);
+  bench<RingQueueSPSC>("SPSC", 1);
+
+  benchBatch<RingQueueMPMC>("MPMC", 64);
+  benchBatch<RingQueueSPSC>("SPSC", 64);
+
+  return 0;
+}
@@ -0,0 +1,114 @@
+#include <assert.h>
+#include <stdint.h>
+#include <chrono>
+#include <iostream>
+#include <thread>
+#include <vector>
+
+#include "BroadcastChannel.h"
+
+
+const int subscriber_num = 3;
+const int publish_num = 100000;
+const int queue_size = 1024;
+
+// every subscriber receives every message, the publisher waits for the
+// slowest one
+void block() {
+  BroadcastChan<int> chan(queue_size);
+
+  std::vector<BroadcastChan<int>::Subscriber> subscribers;
+  for (int i = 0; i < subscriber_num; i++)
+    subscribers.push_back(chan.Subscribe());
+
+  std::vector<int64_t> sums(subscriber_num, 0);
+  std::vector<int> counts(subscriber_num, 0);
+  std::vector<std::thread> threads;
+  for (int i = 0; i < subscriber_num; i++) {
+    threads.emplace_back([&subscribers, &sums, &counts, i]() {
+      int value;
+      while (subscribers[i].Recv(&value)) {
+        // every message once, in the order of publishing
+        assert(value == counts[i]);
+        counts[i]++;
+        sums[i] += value;
+      }
+      std::cout << "subscriber " << i << " sum " << sums[i] << std::endl;
+    });
+  }
+
+  for (int i = 0; i < publish_num; i++)
+    chan.Publish(i);
+  chan.Close();
+
+  for (auto& t : threads)
+    t.join();
+
+  const int64_t expect_sum = (int64_t)publish_num * (publish_num - 1) / 2;
+  for (int i = 0; i < subscriber_num; i++) {
+    assert(counts[i] == publish_num);
+    assert(sums[i] == expect_sum);
+  }
+}
+
+// receive until closed, every message is either received or counted as
+// missed, and a received message is the one after the missed ones
+template<typename Subscriber>
+void checkLag(Subscriber& subscriber, int message_num, bool is_slow) {
+  int value;
+  uint64_t missed;
+  int received_num = 0;
+  uint64_t missed_num = 0;
+  int expect = 0;
+  while (subscriber.Recv(&value, &missed)) {
+    assert(value == expect + (int)missed);
+    expect = value + 1;
+    received_num++;
+    missed_num += missed;
+    if (is_slow && received_num % 64 == 0)
+      std::this_thread::sleep_for(std::chrono::microseconds(100));
+  }
+  std::cout << "received " << received_num << " missed " << missed_num << std::endl;
+  assert(received_num + missed_num == (uint64_t)message_num);
+  // the last messages are still in the ring after Close()
+  assert(expect == message_num);
+}
+
+// the publisher never waits, a slow subscriber is told how many messages
+// it missed
+void lag() {
+  BroadcastChan<int, BroadcastLag> chan(16);
+  BroadcastChan<int, BroadcastLag>::Subscriber subscriber = chan.Subscribe();
+
+  for (int i = 0; i < 100; i++)
+    chan.Publish(i);
+  chan.Close();
+
+  checkLag(subscriber, 100, false);
+}
+
+// a slow subscriber while the publisher keeps publishing
+void lagConcurrent() {
+  BroadcastChan<int, BroadcastLag> chan(64);
+  BroadcastChan<int, BroadcastLag>::Subscriber subscriber = chan.Subscribe();
+
+  std::thread publisher([&chan]() {
+    for (int i = 0; i < publish_num; i++)
+      chan.Publish(i);
+    chan.Close();
+  });
+  checkLag(subscriber, publish_num, true);
+  publisher.join();
+}
+
+
+int main() {
+  std::cout << "----- BroadcastBlock -----" << std::endl;
+  block();
+
+  std::cout << "----- BroadcastLag -----" << std::endl;
+  lag();
+  lagConcurrent();
+
+  return 0;
+}
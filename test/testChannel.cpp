@@ -2,6 +2,7 @@
 #include <iostream>
 #include <thread>
 #include <chrono>
+#include <vector>
 #include "Channel.h"
 
 using namespace zbaselib;
@@ -21,7 +22,7 @@ void fibonacci()
   Chan<int> ch;
   Chan<bool> quit;
 
-  std::thread([&]() {
+  std::thread receiver([&]() {
     for (size_t i = 0; i < 10; i++) {
       //std::this_thread::sleep_for(std::chrono::milliseconds(50));
       std::cout << ch << std::endl;
@@ -29,7 +30,7 @@ void fibonacci()
     // send quit signal
     quit << true;
     std::cout << "-> quit send" << std::endl;
-  }).detach();
+  });
 
   //  std::this_thread::sleep_for(std::chrono::seconds(20));
 
@@ -37,7 +38,7 @@ void fibonacci()
   for (bool go = true; go; ) {
     std::cout << "<<<<<select" << std::endl;
     Select {
-      Case { ch << x, [&]() {
+      Case { ch, x, [&]() {
 	      std::cout << "execute-----" << std::endl;
 	      int t = x;
 	      x = y;
@@ -51,6 +52,211 @@ void fibonacci()
     std::cout << "-------------------select end\n";
   }
   std::cout << "break!!" << std::endl;
+  receiver.join();
+}
+
+
+// same as fibonacci, without heap allocation in the select
+void fibonacciFast()
+{
+  Chan<int> ch;
+  Chan<bool> quit;
+
+  std::thread receiver([&]() {
+    for (size_t i = 0; i < 10; i++)
+      std::cout << ch << std::endl;
+    quit << true;
+  });
+
+  int x = 3, y = 4;
+  for (bool go = true; go; ) {
+    FastSelect(
+      SendCase(ch, x, [&]() {
+        int t = x;
+        x = y;
+        y += t;
+      }),
+      RecvCase(quit, [&](bool) {
+        std::cout << "<- quit recv" << std::endl;
+        go = false;
+      }));
+  }
+  receiver.join();
+}
+
+
+// unbuffered channel, every send waits for its receive
+void unbuffered()
+{
+  Chan<int, 0> ch;
+
+  std::thread sender([&]() {
+    for (int i = 0; i < 5; i++) {
+      ch << i;
+      std::cout << "-> " << i << " sent" << std::endl;
+    }
+  });
+
+  for (int i = 0; i < 5; i++) {
+    int v;
+    ch >> v;
+    std::cout << "<- " << v << " recv" << std::endl;
+  }
+  sender.join();
+}
+
+// a Select send meets a Select receive on an unbuffered channel
+void unbufferedSelect()
+{
+  Chan<int, 0> ch;
+
+  std::thread sender([&]() {
+    for (int i = 0; i < 100; i++) {
+      if (i % 2) {
+        Select {
+          Case { ch, i, []() {} }
+        };
+      } else {
+        FastSelect(SendCase(ch, i, []() {}));
+      }
+    }
+  });
+
+  int total = 0;
+  for (int i = 0; i < 100; i++) {
+    if (i % 3) {
+      Select {
+        Case { ch, [&](int v) { total += v; }}
+      };
+    } else {
+      FastSelect(RecvCase(ch, [&](int v) { total += v; }));
+    }
+  }
+  sender.join();
+  std::cout << "select sum " << total << std::endl;
+}
+
+// capacity given at runtime, channels of any capacity share one type
+int sum(IChan<int> in, int n)
+{
+  int total = 0;
+  for (int i = 0; i < n; i++) {
+    int v;
+    in >> v;
+    total += v;
+  }
+  return total;
+}
+
+void runtimeSized()
+{
+  for (size_t capacity : {1, 64, 128}) {
+    Chan<int> ch(capacity);
+    std::thread sender([&]() {
+      for (int i = 0; i < 1000; i++)
+        ch << i;
+    });
+    std::cout << "capacity " << capacity << " sum " << sum(ch, 1000) << std::endl;
+    sender.join();
+  }
+}
+
+// send and receive many values at once
+void batch()
+{
+  Chan<int> ch(16);
+
+  std::thread sender([&]() {
+    std::vector<int> values(100);
+    for (int i = 0; i < 100; i++)
+      values[i] = i;
+    ch.SendBatch(values.begin(), values.end());
+    ch.Close();
+  });
+
+  int total = 0;
+  int buf[32];
+  size_t n;
+  while ((n = ch.RecvBatch(buf, 32)) > 0) {
+    for (size_t i = 0; i < n; i++)
+      total += buf[i];
+  }
+  sender.join();
+
+  std::vector<int> rest;
+  ch.DrainInto(rest);
+  std::cout << "sum " << total << " rest " << rest.size() << std::endl;
+}
+
+// give up after a timeout
+void timeout()
+{
+  Chan<int> ch;
+  int v = 0;
+  bool ok = ch.RecvFor(v, std::chrono::milliseconds(20));
+  std::cout << "RecvFor ok: " << ok << std::endl;
+
+  ch << 1;
+  ok = ch.SendFor(2, std::chrono::milliseconds(20));
+  std::cout << "SendFor on a full channel ok: " << ok << std::endl;
+
+  Chan<int> never;
+  Select {
+    Case { never, [](int) {
+      std::cout << "<- never" << std::endl;
+    }},
+    Case { After(std::chrono::milliseconds(20)), [](auto) {
+      std::cout << "select timeout" << std::endl;
+    }}
+  };
+
+  FastSelect(
+    RecvCase(never, [](int) {
+      std::cout << "<- never" << std::endl;
+    }),
+    RecvCase(After(std::chrono::milliseconds(20)), [](std::chrono::steady_clock::time_point) {
+      std::cout << "FastSelect timeout" << std::endl;
+    }));
+
+  // cancel the timer of a timeout case which is not picked
+  TimerWheel::TimerId id;
+  auto long_timeout = After(std::chrono::hours(1), &id);
+  Chan<int> ready;
+  ready << 1;
+  Select {
+    Case { ready, [](int v) {
+      std::cout << "<- " << v << " before timeout" << std::endl;
+    }},
+    Case { long_timeout, [](auto) {
+      std::cout << "timeout" << std::endl;
+    }}
+  };
+  std::cout << "timer cancelled: " << GetTimerWheel().CancelTimer(id) << std::endl;
+}
+
+// the values sent before Close() are still received
+void closeDrain()
+{
+  Chan<int> ch(16);
+  for (int i = 0; i < 10; i++)
+    ch << i;
+  ch.Close();
+
+  int num = 0;
+  for (int v : ch) {
+    (void)v;
+    num++;
+  }
+  std::cout << "received " << num << " after close" << std::endl;
+
+  std::pair<int, bool> result = ch.Recv();
+  std::cout << "Recv ok: " << result.second << std::endl;
+
+  Select {
+    Case { ch, [](int, bool ok) {
+      std::cout << "closed case ok: " << ok << std::endl;
+    }}
+  };
 }
 
 
@@ -58,5 +264,28 @@ int main() {
   std::cout << "----- Demo fibonacci -----" << std::endl;
   fibonacci();
 
+  std::cout << "----- Demo fibonacci FastSelect -----" << std::endl;
+  fibonacciFast();
+
+  std::cout << "----- Demo unbuffered -----" << std::endl;
+  unbuffered();
+  unbufferedSelect();
+
+  std::cout << "----- Demo runtime sized -----" << std::endl;
+  runtimeSized();
+
+  std::cout << "----- Demo batch -----" << std::endl;
+  batch();
+
+  std::cout << "----- Demo timeout -----" << std::endl;
+  timeout();
+
+  std::cout << "----- Demo close -----" << std::endl;
+  closeDrain();
+
+#ifdef ZBASELIB_DEBUG
+  DumpTrace();
+#endif
+
   return 0;
 }
@@ -2,6 +2,7 @@
 #include <thread>
 #include <iostream>
 #include <chrono>
+#include <memory>
 
 #include "LockFreeRingQueue.h"
 
@@ -12,26 +13,91 @@ const int push_num = 10000;
 const int pop_num = 10000;
 const int queue_size = 1000;
 
-void push_func(LockFreeRingQueue<int>& lf_queue) {
+// the waiting threads park on a futex instead of busy looping
+typedef LockFreeRingQueue<int, RingQueueMPMC, FutexWaitStrategy> Queue;
+
+void push_func(Queue& lf_queue) {
   for (int i = 0; i < push_num; i++) {
     // make sure we can push success finally
-    while (lf_queue.Push(42) == false) {}
+    lf_queue.PushWait(42);
     std::this_thread::sleep_for(std::chrono::milliseconds(1));
   }
 }
 
-void pop_func(LockFreeRingQueue<int>& lf_queue) {
+void pop_func(Queue& lf_queue) {
   for (int i = 0; i < pop_num; i++) {
     int tmp;
     // make sure we can pop success finally
-    while (lf_queue.Pop(&tmp) == false) {}
+    lf_queue.PopWait(&tmp);
     std::this_thread::sleep_for(std::chrono::milliseconds(1));
   }
 }
 
 
+// PushN/PopN copy in bulk, across the end of the ring, and take as many as fit
+template<typename Mode>
+void testBulk() {
+  LockFreeRingQueue<int, Mode> queue(8);
+  int values[16];
+  int out[16];
+  for (int i = 0; i < 16; i++)
+    values[i] = i;
+
+  // move the positions to 5, so the next 6 values wrap to slots 5..7, 0..2
+  assert(queue.PushN(values, 5) == 5);
+  assert(queue.PopN(out, 5) == 5);
+  assert(queue.PushN(values, 6) == 6);
+  assert(queue.PopN(out, 16) == 6);
+  for (int i = 0; i < 6; i++)
+    assert(out[i] == i);
+
+  // only the free slots are filled, and only the queued values are taken
+  assert(queue.PushN(values, 6) == 6);
+  assert(queue.PushN(values + 6, 10) == 2);
+  assert(queue.PushN(values, 1) == 0);
+  assert(queue.PopN(out, 3) == 3);
+  assert(queue.PopN(out + 3, 16) == 5);
+  assert(queue.PopN(out, 1) == 0);
+  for (int i = 0; i < 8; i++)
+    assert(out[i] == i);
+}
+
+// counts live instances, to see that the queue destroys what it still holds
+struct Counted {
+  static int live;
+  int value;
+  explicit Counted(int v) : value(v) { live++; }
+  ~Counted() { live--; }
+};
+int Counted::live = 0;
+
+// move-only values are built in place and moved out
+void testMoveOnly() {
+  {
+    LockFreeRingQueue<std::unique_ptr<Counted>> queue(4);
+    assert(queue.Emplace(new Counted(1)));
+    assert(queue.Push(std::unique_ptr<Counted>(new Counted(2))));
+    assert(queue.Emplace(new Counted(3)));
+    assert(Counted::live == 3);
+
+    std::unique_ptr<Counted> value;
+    assert(queue.Pop(&value));
+    assert(value && value->value == 1);
+    value.reset();
+    assert(Counted::live == 2);
+  }
+  // the two values left in the queue are released by its destructor
+  assert(Counted::live == 0);
+}
+
 int main() {
-  LockFreeRingQueue<int> lf_queue(queue_size);
+  testMoveOnly();
+  std::cout << "move only ok" << std::endl;
+  testBulk<RingQueueMPMC>();
+  testBulk<RingQueueSPSC>();
+  std::cout << "bulk ok" << std::endl;
+
+  Queue lf_queue(queue_size);
   
   for (int i = 0; i < push_thread_num; i++) {
     std::thread t(push_func, std::ref(lf_queue));
@@ -0,0 +1,63 @@
+#include <assert.h>
+#include <thread>
+#include <vector>
+#include <atomic>
+#include <iostream>
+#include <chrono>
+
+#include "LockFreeSegmentQueue.h"
+
+
+const int push_thread_num = 5;
+const int pop_thread_num = 5;
+const int push_num = 100000;
+const int segment_size = 256;
+
+void push_func(LockFreeSegmentQueue<int>& lf_queue) {
+  for (int i = 0; i < push_num; i++) {
+    // unbounded, push never fails
+    bool ret = lf_queue.Push(i);
+    assert(ret);
+  }
+}
+
+void pop_func(LockFreeSegmentQueue<int>& lf_queue, std::atomic<long long>& pop_sum, std::atomic<int>& pop_count) {
+  int tmp;
+  while (pop_count.load() < push_thread_num * push_num) {
+    if (lf_queue.Pop(&tmp)) {
+      pop_sum += tmp;
+      ++pop_count;
+    } else {
+      std::this_thread::yield();
+    }
+  }
+}
+
+
+int main() {
+  LockFreeSegmentQueue<int> lf_queue(segment_size);
+  std::atomic<long long> pop_sum(0);
+  std::atomic<int> pop_count(0);
+  std::vector<std::thread> threads;
+
+  for (int i = 0; i < push_thread_num; i++)
+    threads.emplace_back(push_func, std::ref(lf_queue));
+
+  for (int i = 0; i < pop_thread_num; i++)
+    threads.emplace_back(pop_func, std::ref(lf_queue), std::ref(pop_sum), std::ref(pop_count));
+
+  while (pop_count.load() < push_thread_num * push_num) {
+    std::cout << "QueueSize: " << lf_queue.GetQueueSize() << std::endl;
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+  }
+
+  for (auto& t : threads)
+    t.join();
+
+  long long expect_sum = (long long)push_thread_num * push_num * (push_num - 1) / 2;
+  std::cout << "PopSum: " << pop_sum.load() << "  Expect: " << expect_sum
+            << "  QueueSize: " << lf_queue.GetQueueSize() << std::endl;
+  assert(pop_sum.load() == expect_sum);
+
+  return 0;
+}
@@ -0,0 +1,71 @@
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "ShmRingQueue.h"
+
+
+const char* queue_name = "/testShmRingQueue";
+const int collector_num = 3;
+const int record_num = 100000;
+const int queue_size = 1024;
+
+struct Record {
+  int64_t id;
+  double value;
+};
+
+typedef ShmRingQueue<Record, FutexWaitStrategy> Queue;
+
+// a collector process pushes its share of the records
+void collector(int index) {
+  Queue queue;
+  if (!queue.Open(queue_name, 0))
+    _exit(1);
+
+  for (int i = index; i < record_num; i += collector_num)
+    queue.PushWait(Record{i, i * 0.5});
+  _exit(0);
+}
+
+// the shipper process pops them
+int main() {
+  Queue::Unlink(queue_name);
+
+  Queue queue;
+  if (!queue.Open(queue_name, queue_size))
+    return 1;
+  printf("creator: %d  cap: %zu\n", queue.IsCreator(), queue.GetCap());
+
+  pid_t pids[collector_num];
+  for (int i = 0; i < collector_num; i++) {
+    pids[i] = fork();
+    assert(pids[i] != -1);
+    if (pids[i] == 0)
+      collector(i);
+  }
+
+  int64_t id_sum = 0;
+  for (int i = 0; i < record_num; i++) {
+    Record record;
+    queue.PopWait(&record);
+    assert(record.value == record.id * 0.5);
+    id_sum += record.id;
+  }
+
+  for (int i = 0; i < collector_num; i++) {
+    int status = 0;
+    waitpid(pids[i], &status, 0);
+    assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+  }
+
+  printf("received %d records, id sum %lld\n", record_num, (long long)id_sum);
+  // every record is received exactly once
+  assert(id_sum == (int64_t)record_num * (record_num - 1) / 2);
+  assert(queue.GetQueueSize() == 0);
+  queue.Close();
+  Queue::Unlink(queue_name);
+  return 0;
+}
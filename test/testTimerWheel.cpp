@@ -0,0 +1,80 @@
+#include <assert.h>
+#include <atomic>
+#include <chrono>
+#include <iostream>
+#include <thread>
+#include <vector>
+
+#include "TimerWheel.h"
+
+using namespace zbaselib;
+
+
+const int timer_num = 1000;
+
+int main() {
+  TimerWheel wheel;
+  std::atomic<int> fired(0);
+  std::atomic<int> early(0);
+
+  // timers from 0ms to 99ms, none may fire before its time
+  auto begin = TimerWheel::Clock::now();
+  std::vector<TimerWheel::TimerId> ids;
+  for (int i = 0; i < timer_num; i++) {
+    auto when = begin + std::chrono::milliseconds(i % 100);
+    ids.push_back(wheel.AddTimer(when, [&fired, &early, when]() {
+      if (TimerWheel::Clock::now() < when)
+        ++early;
+      ++fired;
+    }));
+  }
+
+  // cancel every tenth timer
+  int cancelled = 0;
+  for (int i = 0; i < timer_num; i += 10)
+    cancelled += wheel.CancelTimer(ids[i]);
+
+  while (wheel.GetTimerNum() > 0)
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  auto end = TimerWheel::Clock::now();
+
+  std::cout << "fired: " << fired << "  cancelled: " << cancelled
+            << "  early: " << early << "  elapsed: "
+            << std::chrono::duration_cast<std::chrono::milliseconds>(end - begin).count()
+            << "ms" << std::endl;
+  assert(fired + cancelled == timer_num);
+  assert(early == 0);
+
+  // a fired timer can not be cancelled
+  assert(!wheel.CancelTimer(ids[1]));
+
+  // the wheel sleeps while empty, a new timer still fires on time
+  std::this_thread::sleep_for(std::chrono::milliseconds(50));
+  std::atomic<bool> done(false);
+  begin = TimerWheel::Clock::now();
+  wheel.AddTimer(std::chrono::milliseconds(20), [&done]() { done = true; });
+  while (!done)
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  std::cout << "delay 20ms fired after "
+            << std::chrono::duration_cast<std::chrono::milliseconds>(TimerWheel::Clock::now() - begin).count()
+            << "ms" << std::endl;
+
+  // the wheel sleeps until a long timer, an earlier timer added later
+  // still wakes it on time
+  TimerWheel::TimerId long_id = wheel.AddTimer(std::chrono::hours(1), []() {});
+  std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  done = false;
+  begin = TimerWheel::Clock::now();
+  wheel.AddTimer(std::chrono::milliseconds(20), [&done]() { done = true; });
+  while (!done)
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  auto elapsed = TimerWheel::Clock::now() - begin;
+  std::cout << "delay 20ms before a 1h timer fired after "
+            << std::chrono::duration_cast<std::chrono::milliseconds>(elapsed).count()
+            << "ms" << std::endl;
+  assert(elapsed >= std::chrono::milliseconds(20));
+  assert(wheel.GetTimerNum() == 1);
+  assert(wheel.CancelTimer(long_id));
+
+  return 0;
+}
@@ -0,0 +1,110 @@
+#include "zco.h"
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#define SWITCH_NUM 10000000
+#define DEEP_STACK 16384 // 协程让出时使用的栈的大小
+#define DEDICATED_STACK (64*1024)
+
+static void
+yielder(struct co_schedule* S, void* ud) {
+    int n = *(int*)ud;
+    for (int i = 0; i < n; i++)
+        co_yield(S);
+}
+
+static void
+deep_yielder(struct co_schedule* S, void* ud) {
+    int n = *(int*)ud;
+    char buf[DEEP_STACK];
+    memset(buf, 0, sizeof(buf));
+    // 让 buf 保留在栈上
+    __asm__ volatile("" : : "r"(buf) : "memory");
+    for (int i = 0; i < n; i++)
+        co_yield(S);
+}
+
+static double
+now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+// nco 个协程轮流运行，每次 co_resume 和 co_yield 各是一次切换
+static void
+bench(const char* name, co_func func, void* ud, int nco, int nshared, size_t stack_size) {
+    struct co_schedule* S = co_open(nshared);
+    int ids[8];
+    for (int i = 0; i < nco; i++)
+        ids[i] = co_new_stack(S, func, ud, stack_size);
+
+    int num = 0;
+    double start = now_ns();
+    for (int alive = 1; alive; ) {
+        alive = 0;
+        for (int i = 0; i < nco; i++) {
+            if (co_status(S, ids[i])) {
+                co_resume(S, ids[i]);
+                num += 2;
+                alive = 1;
+            }
+        }
+    }
+    double ns = now_ns() - start;
+
+    printf("%s %s: %d switches, %.1f ns/switch, %.0f switches/s\n",
+#ifdef ZCO_USE_UCONTEXT
+           "ucontext",
+#else
+           "default",
+#endif
+           name, num, ns / num, num / ns * 1e9);
+    co_close(S);
+}
+
+static void
+noop(struct co_schedule* S, void* ud) {
+    (void)S;
+    (void)ud;
+}
+
+// 先创建 num 个挂起的协程占用 id，再测量创建并运行新协程的开销，
+// 空闲 id 列表让创建的开销与已有的协程个数无关
+static void
+bench_spawn(int num) {
+    struct co_schedule* S = co_open(1);
+    int idle = 0;
+    for (int i = 0; i < num; i++)
+        co_new(S, noop, &idle);
+
+    double start = now_ns();
+    for (int round = 0; round < 1000; round++) {
+        for (int i = 0; i < 100; i++)
+            co_spawn(S, noop, NULL);
+        co_run(S);
+    }
+    double ns = now_ns() - start;
+
+    printf("spawn with %d idle coroutines: %.1f ns/spawn\n", num, ns / 100000);
+    co_close(S);
+}
+
+int
+main() {
+    int n = SWITCH_NUM / 2;
+    bench("shared", yielder, &n, 1, 1, 0);
+    bench("dedicated", yielder, &n, 1, 1, DEDICATED_STACK);
+
+    // 两个协程交替运行，只有一个共享栈时每次切换都要保存和恢复栈，
+    // 开销和栈的深度成正比；各占一个共享栈或者使用独立栈时不需要拷贝
+    n = SWITCH_NUM / 40;
+    bench("1 shared stack deep", deep_yielder, &n, 2, 1, 0);
+    bench("2 shared stacks deep", deep_yielder, &n, 2, 2, 0);
+    bench("dedicated deep", deep_yielder, &n, 2, 1, DEDICATED_STACK);
+
+    bench_spawn(0);
+    bench_spawn(50000);
+    return 0;
+}
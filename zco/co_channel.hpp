@@ -0,0 +1,113 @@
+// 让 zco 的协程使用 zbaselib 的 Chan
+//
+// CoScheduler 实现了 zbaselib::CoroutineHook，在 Run() 的线程里运行协程，
+// 协程中阻塞的 Chan 操作只会挂起当前协程，而不是整个线程。
+// 唤醒可以来自其他线程，被唤醒的协程放进就绪队列，由 Run() 依次恢复。
+//
+//   CoScheduler sch;
+//   Chan<int, 0> ch;
+//   sch.Spawn([&]() { ch << 1; });
+//   sch.Spawn([&]() { int v; ch >> v; });
+//   sch.Run();
+//
+// 协程的 id 会被复用，所以一个协程可能被多余地恢复一次，Channel 的
+// 等待逻辑会重新检查条件，可以容忍这种情况。
+
+#pragma once
+
+#include <stdint.h>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+
+#include "Channel.h"
+#include "zco.h"
+
+
+class CoScheduler : public zbaselib::CoroutineHook {
+public:
+  // nshared 为共享栈的个数，见 co_open
+  explicit CoScheduler(int nshared = 1) : S(co_open(nshared)), alive_num(0) {}
+
+  ~CoScheduler() {
+    co_close(S);
+  }
+
+  CoScheduler(const CoScheduler&) = delete;
+  CoScheduler& operator=(const CoScheduler&) = delete;
+
+  // 创建一个协程，在 Run() 中开始运行；stack_size 不为 0 时使用独立栈
+  int Spawn(std::function<void()> func, size_t stack_size = 0) {
+    Task* task = new Task{this, std::move(func)};
+    int id = co_new_stack(S, Entry, task, stack_size);
+    if (id < 0) {
+      delete task;
+      return id;
+    }
+    std::lock_guard<std::mutex> ulock(lock);
+    alive_num++;
+    ready.push_back(id);
+    return id;
+  }
+
+  // 运行所有协程直到它们都结束，没有就绪的协程时等待其他线程的唤醒
+  void Run() {
+    zbaselib::SetCoroutineHook(this);
+    std::unique_lock<std::mutex> ulock(lock);
+    while (alive_num > 0) {
+      if (ready.empty()) {
+        cond.wait(ulock);
+        continue;
+      }
+      int id = ready.front();
+      ready.pop_front();
+      ulock.unlock();
+      if (co_status(S, id) != co_dead && co_status(S, id) != co_running)
+        co_resume(S, id);
+      ulock.lock();
+    }
+    zbaselib::SetCoroutineHook(nullptr);
+  }
+
+  void* Current() override {
+    int id = co_id(S);
+    return id < 0 ? nullptr : reinterpret_cast<void*>(static_cast<intptr_t>(id) + 1);
+  }
+
+  void Suspend() override {
+    co_yield(S);
+  }
+
+  void Resume(void* coroutine) override {
+    int id = static_cast<int>(reinterpret_cast<intptr_t>(coroutine) - 1);
+    {
+      std::lock_guard<std::mutex> ulock(lock);
+      ready.push_back(id);
+    }
+    cond.notify_one();
+  }
+
+private:
+  struct Task {
+    CoScheduler* sch;
+    std::function<void()> func;
+  };
+
+  static void Entry(struct co_schedule* S, void* ud) {
+    (void)S;
+    Task* task = static_cast<Task*>(ud);
+    task->func();
+    CoScheduler* sch = task->sch;
+    delete task;
+
+    std::lock_guard<std::mutex> ulock(sch->lock);
+    sch->alive_num--;
+  }
+
+  struct co_schedule* S;
+  std::mutex lock;               // 保护 ready 和 alive_num
+  std::condition_variable cond;
+  std::deque<int> ready;         // 就绪的协程 id
+  int alive_num;                 // 没有结束的协程个数
+};
@@ -0,0 +1,154 @@
+// 系统调用 hook，参考 libco 的 co_hook_sys_call
+//
+// 和 zco.c 一起链接之后，协程中调用下面这些函数时，如果非阻塞的 fd 还没有
+// 就绪（返回 EAGAIN），不会把 EAGAIN 返回给调用者，而是挂起当前协程，
+// 等 reactor 发现 fd 就绪之后再恢复并重试，所以可以用阻塞的写法编写代码。
+// sleep、usleep 和 poll 也只挂起当前协程。
+//
+// 只有非阻塞的 fd 才能被 hook，阻塞的 fd 依然会阻塞整个线程，创建 fd 时
+// 应该使用 SOCK_NONBLOCK 或 O_NONBLOCK；带有 MSG_DONTWAIT 的 recv/send
+// 不会挂起。不在协程中调用时和原来的函数完全相同。协程需要由 co_run 运行，
+// 否则没有人等待 reactor。
+
+#undef _FORTIFY_SOURCE
+#define _GNU_SOURCE
+#include "zco.h"
+#include <dlfcn.h>
+#include <errno.h>
+#include <limits.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+// 通过 RTLD_NEXT 找到被覆盖的原函数
+#define HOOK_SYS_FUNC(name) \
+    if (!real_##name) \
+        real_##name = (typeof(real_##name))dlsym(RTLD_NEXT, #name)
+
+static typeof(read)* real_read;
+static typeof(write)* real_write;
+static typeof(recv)* real_recv;
+static typeof(send)* real_send;
+static typeof(accept)* real_accept;
+static typeof(connect)* real_connect;
+static typeof(poll)* real_poll;
+static typeof(sleep)* real_sleep;
+static typeof(usleep)* real_usleep;
+
+// 返回 1 表示调用因为 fd 还没有就绪而失败，应该等待之后重试
+static int
+_would_block(ssize_t ret) {
+    return ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+}
+
+ssize_t
+read(int fd, void* buf, size_t nbyte) {
+    HOOK_SYS_FUNC(read);
+    struct co_schedule* S = co_current();
+    ssize_t ret;
+    while (_would_block(ret = real_read(fd, buf, nbyte)) && S) {
+        if (co_wait_fd(S, fd, POLLIN, -1) < 0)
+            return -1;
+    }
+    return ret;
+}
+
+ssize_t
+write(int fd, const void* buf, size_t nbyte) {
+    HOOK_SYS_FUNC(write);
+    struct co_schedule* S = co_current();
+    ssize_t ret;
+    while (_would_block(ret = real_write(fd, buf, nbyte)) && S) {
+        if (co_wait_fd(S, fd, POLLOUT, -1) < 0)
+            return -1;
+    }
+    return ret;
+}
+
+ssize_t
+recv(int fd, void* buf, size_t len, int flags) {
+    HOOK_SYS_FUNC(recv);
+    struct co_schedule* S = (flags & MSG_DONTWAIT) ? NULL : co_current();
+    ssize_t ret;
+    while (_would_block(ret = real_recv(fd, buf, len, flags)) && S) {
+        if (co_wait_fd(S, fd, POLLIN, -1) < 0)
+            return -1;
+    }
+    return ret;
+}
+
+ssize_t
+send(int fd, const void* buf, size_t len, int flags) {
+    HOOK_SYS_FUNC(send);
+    struct co_schedule* S = (flags & MSG_DONTWAIT) ? NULL : co_current();
+    ssize_t ret;
+    while (_would_block(ret = real_send(fd, buf, len, flags)) && S) {
+        if (co_wait_fd(S, fd, POLLOUT, -1) < 0)
+            return -1;
+    }
+    return ret;
+}
+
+int
+accept(int fd, __SOCKADDR_ARG addr, socklen_t* restrict len) {
+    HOOK_SYS_FUNC(accept);
+    struct co_schedule* S = co_current();
+    int ret;
+    while (_would_block(ret = real_accept(fd, addr, len)) && S) {
+        if (co_wait_fd(S, fd, POLLIN, -1) < 0)
+            return -1;
+    }
+    return ret;
+}
+
+// 非阻塞的 connect 返回 EINPROGRESS，fd 可写之后通过 SO_ERROR 取得结果
+int
+connect(int fd, __CONST_SOCKADDR_ARG addr, socklen_t len) {
+    HOOK_SYS_FUNC(connect);
+    struct co_schedule* S = co_current();
+    int ret = real_connect(fd, addr, len);
+    if (ret == 0 || errno != EINPROGRESS || !S)
+        return ret;
+    if (co_wait_fd(S, fd, POLLOUT, -1) < 0)
+        return -1;
+    int err = 0;
+    socklen_t err_len = sizeof(err);
+    if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &err_len) < 0)
+        return -1;
+    if (err) {
+        errno = err;
+        return -1;
+    }
+    return 0;
+}
+
+int
+poll(struct pollfd* fds, nfds_t nfds, int timeout) {
+    HOOK_SYS_FUNC(poll);
+    struct co_schedule* S = co_current();
+    if (!S || timeout == 0)
+        return real_poll(fds, nfds, timeout);
+    return co_poll(S, fds, nfds, timeout);
+}
+
+unsigned int
+sleep(unsigned int seconds) {
+    HOOK_SYS_FUNC(sleep);
+    struct co_schedule* S = co_current();
+    if (!S)
+        return real_sleep(seconds);
+    if (seconds > INT_MAX / 1000)
+        seconds = INT_MAX / 1000;
+    co_sleep(S, (int)seconds * 1000);
+    return 0;
+}
+
+int
+usleep(useconds_t usec) {
+    HOOK_SYS_FUNC(usleep);
+    struct co_schedule* S = co_current();
+    if (!S)
+        return real_usleep(usec);
+    co_sleep(S, (int)((usec + 999) / 1000));
+    return 0;
+}
@@ -31,10 +31,89 @@ test(struct co_schedule* S) {
     printf("main end\n");
 }
 
+// 使用独立栈的协程，切换时不拷贝栈，栈上的数据原地保留
+static void
+summer(struct co_schedule* S, void* ud) {
+    int values[1024];
+    int sum = 0;
+    for (int i = 0; i < 5; i++) {
+        for (int j = 0; j < 1024; j++)
+            values[j] = i;
+        co_yield(S);
+        for (int j = 0; j < 1024; j++)
+            sum += values[j];
+        printf("coroutine %d: sum %d\n", co_id(S), sum);
+    }
+    *(int*)ud = sum;
+}
+
+static void
+test_stack(struct co_schedule* S) {
+    int sum = 0;
+    struct args arg = { 200 };
+
+    int co1 = co_new_stack(S, summer, &sum, 64 * 1024);
+    int co2 = co_new(S, foo, &arg);
+
+    printf("main start\n");
+    while (co_status(S, co1) || co_status(S, co2)) {
+        co_resume(S, co1);
+        co_resume(S, co2);
+    }
+    printf("main end, sum %d\n", sum);
+}
+
+// 生产者每产生一个值就唤醒消费者，然后挂起自己直到消费者取走这个值
+struct pipe {
+    int value;
+    int full;
+    int producer;
+    int consumer;
+};
+
+static void
+produce(struct co_schedule* S, void* ud) {
+    struct pipe* p = ud;
+    for (int i = 1; i <= 3; i++) {
+        p->value = i;
+        p->full = 1;
+        co_wake(S, p->consumer);
+        while (p->full)
+            co_yield(S);
+    }
+}
+
+static void
+consume(struct co_schedule* S, void* ud) {
+    struct pipe* p = ud;
+    for (int i = 0; i < 3; i++) {
+        while (!p->full)
+            co_yield(S);
+        printf("coroutine %d: recv %d\n", co_id(S), p->value);
+        p->full = 0;
+        co_wake(S, p->producer);
+    }
+}
+
+static void
+test_run(struct co_schedule* S) {
+    struct pipe p = { 0, 0, -1, -1 };
+    p.consumer = co_spawn(S, consume, &p);
+    p.producer = co_spawn(S, produce, &p);
+
+    printf("main start\n");
+    int alive = co_run(S);
+    printf("main end, alive %d\n", alive);
+}
+
 int
 main() {
-    struct co_schedule* S = co_open();
+    // co1 和 co2 交替运行，两个共享栈让它们各占一个，切换时不需要拷贝栈
+    struct co_schedule* S = co_open(2);
     test(S);
+    test_stack(S);
+    test_stack(S); // 第二次会复用栈池中的栈
+    test_run(S);
     co_close(S);
 
     return 0;
@@ -0,0 +1,74 @@
+#include <stdio.h>
+#include <thread>
+#include "co_channel.hpp"
+
+using namespace zbaselib;
+
+
+// 两个协程通过无缓冲的 channel 交替运行
+static void
+pingpong() {
+    CoScheduler sch;
+    Chan<int, 0> ping;
+    Chan<int, 0> pong;
+
+    sch.Spawn([&]() {
+        for (int i = 0; i < 3; i++) {
+            ping << i;
+            int v;
+            pong >> v;
+            printf("coroutine a: pong %d\n", v);
+        }
+    });
+    sch.Spawn([&]() {
+        for (int i = 0; i < 3; i++) {
+            int v;
+            ping >> v;
+            printf("coroutine b: ping %d\n", v);
+            pong << v * 10;
+        }
+    });
+    sch.Run();
+}
+
+// 其他线程唤醒阻塞在 channel 上的协程，线程并不会被阻塞
+static void
+fromThread() {
+    CoScheduler sch;
+    Chan<int> ch(4);
+    Chan<bool> quit;
+    int sum = 0;
+
+    sch.Spawn([&]() {
+        for (int v : ch)
+            sum += v;
+        quit << true;
+    });
+    sch.Spawn([&]() {
+        Chan<int> never;
+        FastSelect(
+            RecvCase(never, [](int) {}),
+            RecvCase(quit, [](bool) { printf("select woken by coroutine\n"); }));
+    }, 64 * 1024); // 独立栈
+    sch.Spawn([&]() {
+        printf("another coroutine runs while the others wait\n");
+    });
+
+    std::thread sender([&]() {
+        for (int i = 1; i <= 100; i++)
+            ch << i;
+        ch.Close();
+    });
+    sch.Run();
+    sender.join();
+    printf("sum %d\n", sum);
+}
+
+int
+main() {
+    printf("----- pingpong -----\n");
+    pingpong();
+    printf("----- from thread -----\n");
+    fromThread();
+    return 0;
+}
@@ -0,0 +1,200 @@
+#include "zco.h"
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+// 下面的 read/write/accept/connect/poll/usleep 都是阻塞的写法，
+// 链接 co_hook.c 之后只挂起当前协程，所有连接都在一个线程中处理
+
+static int conn_num = 1000;
+static int listen_fd;
+static struct sockaddr_in server_addr;
+static int echo_ok = 0;
+
+static void
+echo(struct co_schedule* S, void* ud) {
+    int fd = (int)(intptr_t)ud;
+    char buf[64];
+    ssize_t n;
+    while ((n = read(fd, buf, sizeof(buf))) > 0)
+        write(fd, buf, n);
+    close(fd);
+}
+
+static void
+server(struct co_schedule* S, void* ud) {
+    for (int i = 0; i < conn_num; i++) {
+        int fd = accept(listen_fd, NULL, NULL);
+        if (fd < 0) {
+            perror("accept");
+            break;
+        }
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+        co_spawn(S, echo, (void*)(intptr_t)fd);
+    }
+    close(listen_fd);
+}
+
+static void
+client(struct co_schedule* S, void* ud) {
+    int i = (int)(intptr_t)ud;
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (connect(fd, (struct sockaddr*)&server_addr, sizeof(server_addr)) < 0) {
+        perror("connect");
+        close(fd);
+        return;
+    }
+    // 让所有连接同时处于打开状态
+    usleep(1000);
+
+    char msg[32];
+    char buf[32];
+    int len = snprintf(msg, sizeof(msg), "hello %d", i);
+    write(fd, msg, len);
+    int got = 0;
+    while (got < len) {
+        ssize_t n = read(fd, buf + got, sizeof(buf) - got);
+        if (n <= 0)
+            break;
+        got += n;
+    }
+    if (got == len && memcmp(msg, buf, len) == 0)
+        echo_ok++;
+    close(fd);
+}
+
+// 分批创建客户端，避免一次发起的连接超过 listen 的 backlog
+static void
+launcher(struct co_schedule* S, void* ud) {
+    for (int i = 0; i < conn_num; i++) {
+        co_spawn(S, client, (void*)(intptr_t)i);
+        if (i % 1000 == 999)
+            usleep(1000);
+    }
+}
+
+static void
+test_echo(void) {
+    listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    memset(&server_addr, 0, sizeof(server_addr));
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    server_addr.sin_port = 0;
+    bind(listen_fd, (struct sockaddr*)&server_addr, sizeof(server_addr));
+    socklen_t len = sizeof(server_addr);
+    getsockname(listen_fd, (struct sockaddr*)&server_addr, &len);
+    listen(listen_fd, 4096);
+
+    struct co_schedule* S = co_open(16);
+    co_spawn(S, server, NULL);
+    co_spawn(S, launcher, NULL);
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    int alive = co_run(S);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double ms = (end.tv_sec - start.tv_sec) * 1e3 + (end.tv_nsec - start.tv_nsec) / 1e6;
+    printf("echo: %d/%d connections ok in %.1f ms, alive %d\n", echo_ok, conn_num, ms, alive);
+    co_close(S);
+}
+
+static int pipe_fds[2];
+
+static void
+pipe_reader(struct co_schedule* S, void* ud) {
+    struct pollfd pfd = { pipe_fds[0], POLLIN, 0 };
+    int ret = poll(&pfd, 1, 10);
+    printf("poll before write: %d\n", ret);
+
+    char buf[16] = { 0 };
+    ssize_t n = read(pipe_fds[0], buf, sizeof(buf) - 1);
+    printf("read %zd bytes: %s\n", n, buf);
+}
+
+static void
+pipe_writer(struct co_schedule* S, void* ud) {
+    usleep(50 * 1000);
+    write(pipe_fds[1], "wake", 4);
+}
+
+static void
+test_pipe(void) {
+    pipe(pipe_fds);
+    fcntl(pipe_fds[0], F_SETFL, O_NONBLOCK);
+    fcntl(pipe_fds[1], F_SETFL, O_NONBLOCK);
+
+    struct co_schedule* S = co_open(1);
+    co_spawn(S, pipe_reader, NULL);
+    co_spawn(S, pipe_writer, NULL);
+    co_run(S);
+    co_close(S);
+    close(pipe_fds[0]);
+    close(pipe_fds[1]);
+}
+
+// 被 fd 提前唤醒的协程留下的定时器，不能唤醒之后复用同一个 id 的协程
+static int stale_id;
+
+static int64_t
+now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void
+stale_poller(struct co_schedule* S, void* ud) {
+    stale_id = co_id(S);
+    struct pollfd pfd = { pipe_fds[0], POLLIN, 0 };
+    poll(&pfd, 1, 100);
+    char c;
+    read(pipe_fds[0], &c, 1);
+}
+
+static void
+stale_sleeper(struct co_schedule* S, void* ud) {
+    int64_t start = now_ms();
+    usleep(300 * 1000);
+    printf("same id %d, slept %s\n", co_id(S) == stale_id,
+           now_ms() - start >= 300 ? "enough" : "too short");
+}
+
+static void
+stale_writer(struct co_schedule* S, void* ud) {
+    write(pipe_fds[1], "x", 1);
+    // stale_poller 被唤醒并结束，它的 id 被下一个协程复用
+    usleep(10 * 1000);
+    co_spawn(S, stale_sleeper, NULL);
+}
+
+static void
+test_stale_timer(void) {
+    pipe(pipe_fds);
+    fcntl(pipe_fds[0], F_SETFL, O_NONBLOCK);
+    fcntl(pipe_fds[1], F_SETFL, O_NONBLOCK);
+
+    struct co_schedule* S = co_open(1);
+    co_spawn(S, stale_poller, NULL);
+    co_spawn(S, stale_writer, NULL);
+    co_run(S);
+    co_close(S);
+    close(pipe_fds[0]);
+    close(pipe_fds[1]);
+}
+
+int
+main(int argc, char* argv[]) {
+    if (argc > 1)
+        conn_num = atoi(argv[1]);
+    test_pipe();
+    test_stale_timer();
+    test_echo();
+    return 0;
+}
@@ -5,39 +5,347 @@
 #include <string.h>
 #include <stdint.h>
 
+// x86-64 和 aarch64 的 ELF 平台上使用手写的汇编切换上下文，只保存
+// callee-saved 寄存器和栈指针；其他平台或者定义了 ZCO_USE_UCONTEXT 时
+// 使用 ucontext，glibc 的 swapcontext 每次切换都有一次 rt_sigprocmask 系统调用
+#if !defined(ZCO_USE_UCONTEXT) && defined(__ELF__) && (defined(__x86_64__) || defined(__aarch64__))
+    #define ZCO_ASM_CONTEXT
+#endif
+
+#ifndef ZCO_ASM_CONTEXT
 #if __APPLE__ && __MACH__
     #include <sys/ucontext.h>
 #else
     #include <ucontext.h>
 #endif
+#endif
+
+#include <errno.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+// Linux 上使用 epoll 实现等待 fd 和定时器的 reactor
+#ifdef __linux__
+    #define ZCO_REACTOR
+    #include <sys/epoll.h>
+#endif
 
 #define STACK_SIZE (1024*1024)
 #define DEFAULT_COROUTINE 16
+#define STACK_POOL_SIZE 64 // 栈池中最多缓存的独立栈的个数
+#define MAX_EVENTS 1024 // 每次 epoll_wait 最多取出的事件个数
 
 struct coroutine;
 
+#ifdef ZCO_ASM_CONTEXT
+
+// 切出时寄存器被压入自己的栈中，上下文只需要记录栈指针
+typedef struct {
+    void* sp;
+} co_context;
+
+// 将寄存器保存到当前栈上，栈指针存入 *from_sp，然后切换到 to_sp 的栈上
+// 恢复寄存器并返回到 to_sp 保存时的位置
+void zco_swap_context(void** from_sp, void* to_sp);
+// 新协程第一次被切换到时从这里开始执行，调用 entry(arg)，entry 不返回
+void zco_context_entry(void);
+
+#if defined(__x86_64__)
+// 栈上的布局（从低地址到高地址）：mxcsr 和 x87 控制字，r15, r14, r13,
+// r12, rbx, rbp，返回地址
+__asm__(
+    ".text\n"
+    ".globl zco_swap_context\n"
+    ".hidden zco_swap_context\n"
+    ".type zco_swap_context, @function\n"
+    "zco_swap_context:\n"
+    "    pushq %rbp\n"
+    "    pushq %rbx\n"
+    "    pushq %r12\n"
+    "    pushq %r13\n"
+    "    pushq %r14\n"
+    "    pushq %r15\n"
+    "    subq $8, %rsp\n"
+    "    stmxcsr (%rsp)\n"
+    "    fnstcw 4(%rsp)\n"
+    "    movq %rsp, (%rdi)\n"
+    "    movq %rsi, %rsp\n"
+    "    ldmxcsr (%rsp)\n"
+    "    fldcw 4(%rsp)\n"
+    "    addq $8, %rsp\n"
+    "    popq %r15\n"
+    "    popq %r14\n"
+    "    popq %r13\n"
+    "    popq %r12\n"
+    "    popq %rbx\n"
+    "    popq %rbp\n"
+    "    ret\n"
+    ".size zco_swap_context, .-zco_swap_context\n"
+    "\n"
+    ".globl zco_context_entry\n"
+    ".hidden zco_context_entry\n"
+    ".type zco_context_entry, @function\n"
+    "zco_context_entry:\n"
+    "    movq %rbx, %rdi\n"
+    "    callq *%r12\n"
+    "    ud2\n"
+    ".size zco_context_entry, .-zco_context_entry\n"
+);
+
+#define CONTEXT_FRAME_SIZE (8 * 8)
+
+// 构造新协程的初始栈帧，arg 放在 rbx，entry 放在 r12
+static void
+_ctx_make(co_context* ctx, char* stack, size_t size, void (*entry)(void*), void* arg) {
+    // zco_context_entry 开始执行时 rsp 需要 16 字节对齐
+    uintptr_t top = ((uintptr_t)(stack + size) & ~(uintptr_t)15) - 16;
+    uint64_t* frame = (uint64_t*)(top - CONTEXT_FRAME_SIZE);
+    memset(frame, 0, CONTEXT_FRAME_SIZE);
+    frame[0] = 0x1F80 | ((uint64_t)0x037F << 32); // mxcsr 和 x87 控制字的默认值
+    frame[4] = (uint64_t)(uintptr_t)entry;          // r12
+    frame[5] = (uint64_t)(uintptr_t)arg;            // rbx
+    frame[7] = (uint64_t)(uintptr_t)zco_context_entry; // 返回地址
+    ctx->sp = frame;
+}
+
+#elif defined(__aarch64__)
+// 栈上的布局（从低地址到高地址）：x19-x28，x29(fp)，x30(lr)，d8-d15
+__asm__(
+    ".text\n"
+    ".globl zco_swap_context\n"
+    ".hidden zco_swap_context\n"
+    ".type zco_swap_context, %function\n"
+    "zco_swap_context:\n"
+    "    sub sp, sp, #160\n"
+    "    stp x19, x20, [sp, #0]\n"
+    "    stp x21, x22, [sp, #16]\n"
+    "    stp x23, x24, [sp, #32]\n"
+    "    stp x25, x26, [sp, #48]\n"
+    "    stp x27, x28, [sp, #64]\n"
+    "    stp x29, x30, [sp, #80]\n"
+    "    stp d8, d9, [sp, #96]\n"
+    "    stp d10, d11, [sp, #112]\n"
+    "    stp d12, d13, [sp, #128]\n"
+    "    stp d14, d15, [sp, #144]\n"
+    "    mov x2, sp\n"
+    "    str x2, [x0]\n"
+    "    mov sp, x1\n"
+    "    ldp x19, x20, [sp, #0]\n"
+    "    ldp x21, x22, [sp, #16]\n"
+    "    ldp x23, x24, [sp, #32]\n"
+    "    ldp x25, x26, [sp, #48]\n"
+    "    ldp x27, x28, [sp, #64]\n"
+    "    ldp x29, x30, [sp, #80]\n"
+    "    ldp d8, d9, [sp, #96]\n"
+    "    ldp d10, d11, [sp, #112]\n"
+    "    ldp d12, d13, [sp, #128]\n"
+    "    ldp d14, d15, [sp, #144]\n"
+    "    add sp, sp, #160\n"
+    "    ret\n"
+    ".size zco_swap_context, .-zco_swap_context\n"
+    "\n"
+    ".globl zco_context_entry\n"
+    ".hidden zco_context_entry\n"
+    ".type zco_context_entry, %function\n"
+    "zco_context_entry:\n"
+    "    mov x0, x19\n"
+    "    blr x20\n"
+    "    brk #0\n"
+    ".size zco_context_entry, .-zco_context_entry\n"
+);
+
+#define CONTEXT_FRAME_SIZE (20 * 8)
+
+// 构造新协程的初始栈帧，arg 放在 x19，entry 放在 x20
+static void
+_ctx_make(co_context* ctx, char* stack, size_t size, void (*entry)(void*), void* arg) {
+    // sp 必须 16 字节对齐
+    uintptr_t top = ((uintptr_t)(stack + size) & ~(uintptr_t)15) - 16;
+    uint64_t* frame = (uint64_t*)(top - CONTEXT_FRAME_SIZE);
+    memset(frame, 0, CONTEXT_FRAME_SIZE);
+    frame[0] = (uint64_t)(uintptr_t)arg;                // x19
+    frame[1] = (uint64_t)(uintptr_t)entry;              // x20
+    frame[11] = (uint64_t)(uintptr_t)zco_context_entry; // x30
+    ctx->sp = frame;
+}
+#endif
+
+// 保存当前上下文到 from，切换到 to
+#define _ctx_swap(from, to) zco_swap_context(&(from)->sp, (to)->sp)
+
+#else // ucontext
+
+typedef ucontext_t co_context;
+
+static void
+_ctx_entry(uint32_t entry_low32, uint32_t entry_hi32, uint32_t arg_low32, uint32_t arg_hi32) {
+    void (*entry)(void*) = (void (*)(void*))((uintptr_t)entry_low32 | ((uintptr_t)entry_hi32 << 32));
+    void* arg = (void*)((uintptr_t)arg_low32 | ((uintptr_t)arg_hi32 << 32));
+    entry(arg);
+}
+
+static void
+_ctx_make(co_context* ctx, char* stack, size_t size, void (*entry)(void*), void* arg) {
+    //初始化ucontext_t结构体,将当前的上下文放到ctx里面
+    getcontext(ctx);
+    ctx->uc_stack.ss_sp = stack;
+    ctx->uc_stack.ss_size = size;
+    // entry 不返回，不需要 uc_link
+    ctx->uc_link = NULL;
+    uintptr_t e = (uintptr_t)entry;
+    uintptr_t a = (uintptr_t)arg;
+    makecontext(ctx, (void(*)(void))_ctx_entry, 4,
+                (uint32_t)e, (uint32_t)(e >> 32), (uint32_t)a, (uint32_t)(a >> 32));
+}
+
+// 必须直接在 co_yield 中调用 swapcontext，如果多一层函数调用，它的栈帧
+// 会在 _save_stack 保存的范围之外
+#define _ctx_swap(from, to) swapcontext((from), (to))
+
+#endif // ZCO_ASM_CONTEXT
+
+// 独立栈，mmap 分配，最低的一页是保护页，栈溢出时触发 SIGSEGV
+// 而不是悄悄改写其他内存
+struct co_stack {
+    char* base;             // mmap 返回的地址，包括保护页
+    size_t size;            // 保护页之上可用的大小
+};
+
+// 共享栈，分配到同一个栈的协程轮流使用。协程切出时并不保存栈，
+// 等到另一个协程要使用这个栈时才保存 owner 的栈，所以 owner 再次
+// 运行时不需要任何拷贝
+struct co_shared_stack {
+    char* stack;              // 运行时栈
+    struct coroutine* owner;  // 栈上现在保存着谁的内容
+};
+
+// 协程等待的一个 fd，挂在 co_fd_wait 的链表上
+struct co_waiter {
+    int id;                   // 等待的协程
+    int fd;
+    short events;             // 等待的事件，POLLIN 或 POLLOUT
+    struct co_waiter* next;
+};
+
+// 一个 fd 上所有的等待者
+struct co_fd_wait {
+    struct co_waiter* head;
+    uint32_t registered;      // 已经注册到 epoll 的事件
+};
+
+// 等待超时的协程，seq 和协程的 wait_seq 不同时说明协程已经被唤醒，定时器过期了
+struct co_timer {
+    int64_t deadline;         // 单位毫秒
+    int id;
+    uint64_t seq;
+};
+
 // 协程调度器
 struct co_schedule {
-    char stack[STACK_SIZE]; // 共享栈，运行时使用
-    ucontext_t main;        // 主协程上下文
+    struct co_shared_stack* shared; // 共享栈数组
+    int nshared;            // 共享栈的个数
+    int next_shared;        // 下一个新协程轮转分配到的共享栈
+    co_context main;        // 主协程上下文
     int nco;                // 协程的个数
     int cap;                // 协程管理器的容量
     int running;            // 正在运行的协程的 id
     struct coroutine **co;  // 协程数组
+    int* free_id;           // 空闲 id 的栈，容量为 cap，分配 id 是 O(1) 的
+    int nfree_id;           // 空闲 id 的个数
+    int* runq;              // 就绪队列，保存协程 id 的环形缓冲区
+    int runq_cap;           // 就绪队列的容量
+    int runq_head;          // 队头的下标
+    int runq_num;           // 就绪队列中 id 的个数
+    int nfree_stack;        // 栈池中空闲独立栈的个数
+    struct co_stack free_stack[STACK_POOL_SIZE]; // 栈池，回收结束的协程的独立栈
+    int epfd;               // reactor 的 epoll fd，第一次使用时创建
+    int nwaiting;           // 等待 fd 或者定时器的协程个数
+    uint64_t wait_seq;      // 最近一次等待的序号，id 会被复用，序号不会
+    struct co_fd_wait* fds; // 以 fd 为下标的等待者
+    int nfds;               // fds 的大小
+    struct co_timer* timer; // 定时器的最小堆
+    int ntimer;
+    int timer_cap;
 };
 
 // 协程
 struct coroutine {
     co_func func;            // 协程执行的函数
     void* ud;                // 协程参数
-    ucontext_t ctx;          // 协程上下文
+    co_context ctx;          // 协程上下文
     struct co_schedule* sch; // 协程所属的调度器
     ptrdiff_t cap;           // 协程申请的堆内存大小
     ptrdiff_t size;          // 保存当前协程时使用的堆内存大小
     int status;              // 协程的运行状态
     char* stack_ptr;         // 协程切出后保存的运行时栈的地址
+    char* stack_sp;          // 切出时的栈顶，[stack_sp, 栈底) 是需要保存的部分
+    struct co_shared_stack* shared; // 使用的共享栈，使用独立栈时为 NULL
+    struct co_stack stack;   // 独立栈，base 为 NULL 时使用共享栈
+    int queued;              // 是否在就绪队列中
+    int waiting;             // 是否在等待 fd 或者定时器
+    int wait_revents;        // 唤醒时就绪的事件，超时为 0
+    uint64_t wait_seq;       // 本次等待的序号，用来识别过期的定时器
+    struct co_waiter waiter; // 只等待一个 fd 时使用，不用分配内存
+    struct co_waiter* waiters; // 正在等待的 fd，挂起期间不能放在共享栈上
 };
 
+// 当前线程正在运行协程的调度器
+static __thread struct co_schedule* current = NULL;
+
+static size_t
+_page_size(void) {
+    static size_t page_size = 0;
+    if (page_size == 0)
+        page_size = (size_t)sysconf(_SC_PAGESIZE);
+    return page_size;
+}
+
+// 从栈池中取一个大小相同的栈，没有时才 mmap 一个新的
+static int
+_stack_alloc(struct co_schedule* S, size_t size, struct co_stack* stack) {
+    size_t page = _page_size();
+    size = (size + page - 1) / page * page;
+    for (int i = S->nfree_stack - 1; i >= 0; i--) {
+        if (S->free_stack[i].size == size) {
+            *stack = S->free_stack[i];
+            S->free_stack[i] = S->free_stack[--S->nfree_stack];
+            return 1;
+        }
+    }
+
+    char* base = mmap(NULL, size + page, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (base == MAP_FAILED)
+        return 0;
+    // 栈从高地址向低地址增长，保护页放在最低处
+    if (mprotect(base, page, PROT_NONE) != 0) {
+        munmap(base, size + page);
+        return 0;
+    }
+    stack->base = base;
+    stack->size = size;
+    return 1;
+}
+
+// 将栈放回栈池，栈池满了才 munmap
+static void
+_stack_free(struct co_schedule* S, struct co_stack* stack) {
+    if (S->nfree_stack < STACK_POOL_SIZE) {
+        S->free_stack[S->nfree_stack++] = *stack;
+    } else {
+        munmap(stack->base, stack->size + _page_size());
+    }
+    stack->base = NULL;
+}
+
+// 独立栈中可用部分的起始地址
+static char*
+_stack_bottom(struct co_stack* stack) {
+    return stack->base + _page_size();
+}
+
 // 分配一个新协程，并分配他的内存
 struct coroutine*
 _co_new(struct co_schedule* S, co_func func, void* ud) {
@@ -49,6 +357,15 @@ _co_new(struct co_schedule* S, co_func func, void* ud) {
     co->size = 0; // 协程使用了的堆空间大小
     co->status = co_ready;
     co->stack_ptr = NULL;
+    co->stack_sp = NULL;
+    co->shared = NULL;
+    co->stack.base = NULL;
+    co->stack.size = 0;
+    co->queued = 0;
+    co->waiting = 0;
+    co->wait_revents = 0;
+    co->wait_seq = 0;
+    co->waiters = NULL;
     return co;
 }
 
@@ -56,19 +373,52 @@ _co_new(struct co_schedule* S, co_func func, void* ud) {
 void
 _co_delete(struct coroutine* co) {
     free(co->stack_ptr);
+    if (co->shared && co->shared->owner == co)
+        co->shared->owner = NULL;
+    if (co->stack.base)
+        _stack_free(co->sch, &co->stack);
+    if (co->waiters != &co->waiter)
+        free(co->waiters);
     free(co);
 }
 
-// 创建一个协程调度器
+// 创建一个协程调度器，nshared 为共享栈的个数
 struct co_schedule*
-co_open(void) {
+co_open(int nshared) {
     struct co_schedule* S = malloc(sizeof(*S));
+    if (nshared < 1)
+        nshared = 1;
+    S->nshared = nshared;
+    S->next_shared = 0;
+    S->shared = malloc(sizeof(struct co_shared_stack) * nshared);
+    for (int i = 0; i < nshared; i++) {
+        S->shared[i].stack = malloc(STACK_SIZE);
+        S->shared[i].owner = NULL;
+    }
     S->nco = 0;
     S->cap = DEFAULT_COROUTINE;
     S->running = -1;
     // 分配协程数组
     S->co = malloc(sizeof(struct coroutine*) * S->cap);
     memset(S->co, 0, sizeof(struct coroutine*) * S->cap);
+    // 倒序入栈，先分配小的 id
+    S->free_id = malloc(sizeof(int) * S->cap);
+    S->nfree_id = 0;
+    for (int id = S->cap - 1; id >= 0; id--)
+        S->free_id[S->nfree_id++] = id;
+    S->runq_cap = DEFAULT_COROUTINE;
+    S->runq = malloc(sizeof(int) * S->runq_cap);
+    S->runq_head = 0;
+    S->runq_num = 0;
+    S->nfree_stack = 0;
+    S->epfd = -1;
+    S->nwaiting = 0;
+    S->wait_seq = 0;
+    S->fds = NULL;
+    S->nfds = 0;
+    S->timer = NULL;
+    S->ntimer = 0;
+    S->timer_cap = 0;
     return S;
 }
 
@@ -84,49 +434,116 @@ co_close(struct co_schedule* S) {
     }
     free(S->co);
     S->co = NULL;
+    free(S->free_id);
+    free(S->runq);
+    for (int i = 0; i < S->nshared; i++)
+        free(S->shared[i].stack);
+    free(S->shared);
+    S->shared = NULL;
+    for (int i = 0; i < S->nfree_stack; i++)
+        munmap(S->free_stack[i].base, S->free_stack[i].size + _page_size());
+    S->nfree_stack = 0;
+    if (S->epfd >= 0)
+        close(S->epfd);
+    free(S->fds);
+    free(S->timer);
     free(S);
 }
 
+// 将协程交由协程管理器管理，返回协程的 id
+static int
+_co_add(struct co_schedule* S, struct coroutine* co) {
+    // 如果没有空闲的 id，则要对协程管理器进行扩容
+    if (S->nfree_id == 0) {
+        // 按 2 倍进行扩容，新增的 id 都是空闲的
+        S->co = realloc(S->co, S->cap * 2 * sizeof(struct coroutine*));
+        memset(S->co + S->cap, 0, S->cap * sizeof(struct coroutine*));
+        S->free_id = realloc(S->free_id, S->cap * 2 * sizeof(int));
+        for (int id = S->cap * 2 - 1; id >= S->cap; id--)
+            S->free_id[S->nfree_id++] = id;
+        S->cap *= 2;
+    }
+    int id = S->free_id[--S->nfree_id];
+    S->co[id] = co;
+    S->nco += 1;
+    return id;
+}
+
 // 创建一个新的协程并将其交由协程管理器管理
 int
 co_new(struct co_schedule* S, co_func func, void* ud) {
+    return co_new_shared(S, func, ud, -1);
+}
+
+// 创建一个使用第 hint 个共享栈的协程，hint 小于 0 时轮转分配
+int
+co_new_shared(struct co_schedule* S, co_func func, void* ud, int hint) {
     struct coroutine* co = _co_new(S, func, ud);
-    // 如果当前协程数量超过了协程管理器的容量，则要对协程
-    // 管理器进行扩容
-    if (S->nco >= S->cap) {
-        int id = S->cap;
-        // 按 2 倍进行扩容
-        S->co = realloc(S->co, S->cap * 2 * sizeof(struct coroutine*));
-        memset(S->co + S->cap, 0, S->cap * sizeof(struct coroutine*));
-        S->co[S->cap] = co;
-        S->cap *= 2;
-        S->nco += 1;
-        return id;
-    } else {
-        for (int i = 0; i < S->cap; i++) {
-            int id = (i + S->nco) % S->cap;
-            if (S->co[id] == NULL) {
-                S->co[id] = co;
-                S->nco += 1;
-                return id;
-            }
-        }
+    if (hint < 0) {
+        hint = S->next_shared;
+        S->next_shared = (S->next_shared + 1) % S->nshared;
+    }
+    co->shared = &S->shared[hint % S->nshared];
+    return _co_add(S, co);
+}
+
+// 创建一个协程，stack_size 不为 0 时使用独立栈
+int
+co_new_stack(struct co_schedule* S, co_func func, void* ud, size_t stack_size) {
+    if (stack_size == 0)
+        return co_new_shared(S, func, ud, -1);
+    struct coroutine* co = _co_new(S, func, ud);
+    if (!_stack_alloc(S, stack_size, &co->stack)) {
+        free(co);
+        return -1;
     }
-    assert(0);
-    return -1;
+    return _co_add(S, co);
 }
 
 static void
-mainfunc(uint32_t low32, uint32_t hi32) {
-    uintptr_t ptr = (uintptr_t)low32 | ((uintptr_t)hi32 << 32);
-    struct co_schedule* S = (struct co_schedule*)ptr;
+mainfunc(void* ud) {
+    struct co_schedule* S = (struct co_schedule*)ud;
     int id = S->running;
     struct coroutine* C = S->co[id];
     C->func(S, C->ud); // 真正启动一个协程
-    _co_delete(C); // 协程执行完成之后进行释放
-    S->co[id] = NULL;
-    S->nco -= 1;
+    // 还在协程自己的栈上，不能释放独立栈，由 co_resume 在切回之后释放
+    C->status = co_dead;
     S->running = -1;
+    // 切回主协程，这个上下文不会再被恢复
+    co_context dead;
+    _ctx_swap(&dead, &S->main);
+}
+
+// 保存运行时栈 [bottom, top) 的内容
+static void
+_copy_stack(struct coroutine* C, char* bottom, char* top) {
+    assert(top - bottom <= STACK_SIZE);
+    // 如果协程之前分配的栈空间不够用来保存本次切换
+    // 时的栈的话，则重新申请空间
+    if (C->cap < top - bottom) {
+        free(C->stack_ptr);
+        C->cap = top - bottom; // 本次需要的栈的大小
+        C->stack_ptr = malloc(C->cap);
+    }
+    C->size = top - bottom; // 当前运行时栈实际使用的大小
+    // 将运行时栈拷贝到当前协程的数据结构中
+    // 接下来这个共享栈就会被另一个协程使用
+    memcpy(C->stack_ptr, bottom, C->size);
+}
+
+// 让 C 占用它的共享栈。栈上还是 C 自己的内容时什么都不用做，否则先保存
+// 上一个使用者的栈，再把 C 上次保存的栈拷贝回来
+static void
+_acquire_shared(struct coroutine* C) {
+    struct co_shared_stack* shared = C->shared;
+    char* top = shared->stack + STACK_SIZE;
+    if (shared->owner == C)
+        return;
+    if (shared->owner)
+        _copy_stack(shared->owner, shared->owner->stack_sp, top);
+    shared->owner = C;
+    if (C->status == co_suspend)
+        memcpy(top - C->size, C->stack_ptr, C->size);
 }
 
 // 启动一个协程，并将控制权交给该协程
@@ -138,60 +555,60 @@ co_resume(struct co_schedule* S, int id) {
     struct coroutine* C = S->co[id];
     if (C == NULL)
         return;
+    struct co_schedule* prev = current;
+    current = S;
     int status = C->status;
     switch(status) {
     case co_ready: // 这个协程之前没有运行过
-        //初始化ucontext_t结构体,将当前的上下文放到C->ctx里面
-        getcontext(&C->ctx);
-        // 将协程管理器的 stack 成员设置为当前的运行时栈顶
-        // 这个协程管理器管理的所有协程都将 stack 作为自己的运行时栈
-        C->ctx.uc_stack.ss_sp = S->stack;
-        // 设置运行时栈的大小
-        C->ctx.uc_stack.ss_size = STACK_SIZE;
-        // 设置协程执行完之后切换到 S->main 协程（主协程）继续执行
-        C->ctx.uc_link = &S->main;
+        // 使用共享栈的协程都将 S->stack 作为自己的运行时栈
+        // 协程从 mainfunc 开始执行，执行完之后切换回 S->main（主协程）
+        if (C->stack.base) {
+            _ctx_make(&C->ctx, _stack_bottom(&C->stack), C->stack.size, mainfunc, S);
+        } else {
+            _acquire_shared(C);
+            _ctx_make(&C->ctx, C->shared->stack, STACK_SIZE, mainfunc, S);
+        }
         S->running = id;
         C->status = co_running;
-        uintptr_t ptr = (uintptr_t)S;
-        makecontext(&C->ctx, (void(*)(void))mainfunc, 2, (uint32_t)ptr, (uint32_t)(ptr>>32));
-        // 将当前的上下问放入 S->main, 然后用 C->ctx 替换当前上下文
-        // 等 C->ctx 执行完之后，就会跳回到此处继续执行
-        swapcontext(&S->main, &C->ctx);
+        // 将当前的上下文放入 S->main, 然后切换到 C->ctx
+        // 等协程让出或者执行完之后，就会跳回到此处继续执行
+        _ctx_swap(&S->main, &C->ctx);
         break;
     case co_suspend: // 这个协程之前运行过，现在睡眠了
-        // 将协程上次保存的运行时栈的信息拷贝回运行时栈
-        memcpy(S->stack + STACK_SIZE - C->size, C->stack_ptr, C->size);
+        // 必要时将协程上次保存的运行时栈的信息拷贝回运行时栈，独立栈不需要拷贝
+        if (C->shared)
+            _acquire_shared(C);
         S->running = id;
         C->status = co_running;
-        swapcontext(&S->main, &C->ctx);
+        _ctx_swap(&S->main, &C->ctx);
         break;
     default:
         assert(0);
     }
-}
+    current = prev;
 
-// 保存运行时栈
-static void
-_save_stack(struct coroutine* C, char* top) {
-    // dummy 变量是被分配在栈上的，由于 Linux 栈内存
-    // 的增长方向时从高地址到低地址，所以现在分配的 dummy
-    // 的地址一定是栈顶。那么 top - & dummy 就是当前的运行
-    // 时栈的大小
-    char dummy = 0;
-    assert(top - &dummy <= STACK_SIZE);
-    // 如果协程之前分配的栈空间不够用来保存本次切换
-    // 时的栈的话，则重新申请空间
-    if (C->cap < top - &dummy) {
-        free(C->stack_ptr);
-        C->cap = top - &dummy; // 本次需要的栈的大小
-        C->stack_ptr = malloc(C->cap);
+    if (C->status == co_dead) {
+        _co_delete(C); // 协程执行完成之后进行释放
+        S->co[id] = NULL;
+        S->nco -= 1;
+        S->free_id[S->nfree_id++] = id;
+        return;
     }
-    C->size = top - &dummy; // 当前运行时栈实际使用的大小
-    // 将运行时栈拷贝到当前协程的数据结构中
-    // 接下来就当前写成就会让出 CPU, 协程管理器的运行时栈
-    // 就会被下一个分配到 CPU 的协程使用
-    memcpy(C->stack_ptr, &dummy, C->size);
+
+#ifdef ZCO_ASM_CONTEXT
+    // 协程的寄存器保存在它自己的栈上，从保存的栈指针到栈底就是需要保存的部分
+    C->stack_sp = (char*)C->ctx.sp;
+#endif
+}
+
+#ifndef ZCO_ASM_CONTEXT
+// 返回当前的栈顶。ucontext 的寄存器保存在 C->ctx 中，运行时栈只需要保存到
+// co_yield 的栈帧，这个函数的栈帧在 co_yield 的栈帧之下，取它的帧地址就够了
+static __attribute__((noinline)) char*
+_stack_top(void) {
+    return __builtin_frame_address(0);
 }
+#endif
 
 // 当前运行中的协程让出 CPU，切换到主协程继续运行
 void
@@ -200,12 +617,16 @@ co_yield(struct co_schedule* S) {
     assert(id >= 0);
     // 从协程管理器中取出当前协程
     struct coroutine* C = S->co[id];
-    // todo 这行 assert 的意义是什么？
-    assert((char*)&C > S->stack);
-    _save_stack(C, S->stack + STACK_SIZE);
+#ifndef ZCO_ASM_CONTEXT
+    if (C->shared) {
+        // 当前一定运行在共享栈上
+        assert((char*)&C > C->shared->stack);
+        C->stack_sp = _stack_top();
+    }
+#endif
     C->status = co_suspend;
     S->running = -1;
-    swapcontext(&C->ctx, &S->main);
+    _ctx_swap(&C->ctx, &S->main);
 }
 
 // 获取给定 id 的协程的运行状态
@@ -222,4 +643,333 @@ co_status(struct co_schedule* S, int id) {
 int
 co_id(struct co_schedule* S) {
     return S->running;
-}
\ No newline at end of file
+}
+
+// 将协程放入就绪队列，已经在队列中时什么都不做
+void
+co_wake(struct co_schedule* S, int id) {
+    assert(id >= 0 && id < S->cap);
+    struct coroutine* C = S->co[id];
+    if (C == NULL || C->queued)
+        return;
+    C->queued = 1;
+    // 队列满了按 2 倍扩容，同时把环形缓冲区中的 id 按顺序搬到开头
+    if (S->runq_num == S->runq_cap) {
+        int* runq = malloc(sizeof(int) * S->runq_cap * 2);
+        for (int i = 0; i < S->runq_num; i++)
+            runq[i] = S->runq[(S->runq_head + i) % S->runq_cap];
+        free(S->runq);
+        S->runq = runq;
+        S->runq_cap *= 2;
+        S->runq_head = 0;
+    }
+    S->runq[(S->runq_head + S->runq_num) % S->runq_cap] = id;
+    S->runq_num += 1;
+}
+
+// 创建一个使用共享栈的协程，并放入就绪队列
+int
+co_spawn(struct co_schedule* S, co_func func, void* ud) {
+    int id = co_new(S, func, ud);
+    co_wake(S, id);
+    return id;
+}
+
+// 返回当前线程中正在运行的协程所属的调度器，不在协程中时返回 NULL
+struct co_schedule*
+co_current(void) {
+    return current;
+}
+
+#ifdef ZCO_REACTOR
+static int64_t
+_now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void
+_timer_push(struct co_schedule* S, int64_t deadline, int id, uint64_t seq) {
+    if (S->ntimer == S->timer_cap) {
+        S->timer_cap = S->timer_cap ? S->timer_cap * 2 : DEFAULT_COROUTINE;
+        S->timer = realloc(S->timer, sizeof(struct co_timer) * S->timer_cap);
+    }
+    int i = S->ntimer++;
+    while (i > 0 && S->timer[(i - 1) / 2].deadline > deadline) {
+        S->timer[i] = S->timer[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+    S->timer[i].deadline = deadline;
+    S->timer[i].id = id;
+    S->timer[i].seq = seq;
+}
+
+static void
+_timer_pop(struct co_schedule* S) {
+    struct co_timer last = S->timer[--S->ntimer];
+    int i = 0;
+    for (;;) {
+        int child = i * 2 + 1;
+        if (child >= S->ntimer)
+            break;
+        if (child + 1 < S->ntimer && S->timer[child + 1].deadline < S->timer[child].deadline)
+            child++;
+        if (S->timer[child].deadline >= last.deadline)
+            break;
+        S->timer[i] = S->timer[child];
+        i = child;
+    }
+    if (S->ntimer > 0)
+        S->timer[i] = last;
+}
+
+static int
+_epoll_fd(struct co_schedule* S) {
+    if (S->epfd < 0)
+        S->epfd = epoll_create1(EPOLL_CLOEXEC);
+    return S->epfd;
+}
+
+// 按照 fd 上所有等待者的事件更新 epoll 的注册，EPOLLIN 等和 POLLIN 等的值相同
+static int
+_fd_update(struct co_schedule* S, int fd) {
+    struct co_fd_wait* w = &S->fds[fd];
+    uint32_t events = 0;
+    for (struct co_waiter* p = w->head; p; p = p->next)
+        events |= (uint32_t)p->events;
+    if (events == w->registered)
+        return 0;
+
+    int epfd = _epoll_fd(S);
+    if (epfd < 0)
+        return -1;
+    int ret;
+    if (events == 0) {
+        // fd 关闭之后 epoll 会自动移除它，这时 EPOLL_CTL_DEL 失败也没有关系
+        epoll_ctl(epfd, EPOLL_CTL_DEL, fd, NULL);
+        ret = 0;
+    } else {
+        struct epoll_event ev;
+        ev.events = events;
+        ev.data.fd = fd;
+        // 注册过的 fd 可能已经被关闭并且复用了，失败时换另一种操作再试一次
+        int op = w->registered ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+        ret = epoll_ctl(epfd, op, fd, &ev);
+        if (ret < 0 && (errno == ENOENT || errno == EEXIST))
+            ret = epoll_ctl(epfd, op == EPOLL_CTL_MOD ? EPOLL_CTL_ADD : EPOLL_CTL_MOD, fd, &ev);
+    }
+    if (ret == 0)
+        w->registered = events;
+    return ret;
+}
+
+static int
+_fd_add_waiter(struct co_schedule* S, struct co_waiter* waiter) {
+    int fd = waiter->fd;
+    if (fd >= S->nfds) {
+        int nfds = S->nfds ? S->nfds : DEFAULT_COROUTINE;
+        while (nfds <= fd)
+            nfds *= 2;
+        S->fds = realloc(S->fds, sizeof(struct co_fd_wait) * nfds);
+        memset(S->fds + S->nfds, 0, sizeof(struct co_fd_wait) * (nfds - S->nfds));
+        S->nfds = nfds;
+    }
+    struct co_fd_wait* w = &S->fds[fd];
+    waiter->next = w->head;
+    w->head = waiter;
+    if (_fd_update(S, fd) < 0) {
+        w->head = waiter->next;
+        return -1;
+    }
+    return 0;
+}
+
+static void
+_fd_remove_waiter(struct co_schedule* S, struct co_waiter* waiter) {
+    struct co_fd_wait* w = &S->fds[waiter->fd];
+    for (struct co_waiter** p = &w->head; *p; p = &(*p)->next) {
+        if (*p == waiter) {
+            *p = waiter->next;
+            break;
+        }
+    }
+    _fd_update(S, waiter->fd);
+}
+
+// 唤醒等待中的协程，revents 为 0 表示超时
+static void
+_wake_waiting(struct co_schedule* S, struct coroutine* C, int id, int revents) {
+    C->waiting = 0;
+    C->wait_revents = revents;
+    S->nwaiting -= 1;
+    co_wake(S, id);
+}
+
+// 挂起当前协程直到被 reactor 唤醒，timeout 小于 0 时不超时
+static int
+_wait(struct co_schedule* S, int timeout) {
+    int id = S->running;
+    struct coroutine* C = S->co[id];
+    C->waiting = 1;
+    C->wait_revents = 0;
+    // 序号来自调度器，复用同一个 id 的新协程不会和过期的定时器撞上
+    C->wait_seq = ++S->wait_seq;
+    S->nwaiting += 1;
+    if (timeout >= 0)
+        _timer_push(S, _now_ms() + timeout, id, C->wait_seq);
+    // 期间被 co_wake 唤醒时继续等待
+    while (C->waiting)
+        co_yield(S);
+    return C->wait_revents;
+}
+
+// 等待 fds 中任意一个就绪，返回就绪的事件，超时返回 0
+static int
+_wait_fds(struct co_schedule* S, struct pollfd* fds, nfds_t nfds, int timeout) {
+    struct coroutine* C = S->co[S->running];
+    // 等待者必须放在堆上，协程挂起之后共享栈上的内容会被换走
+    struct co_waiter* waiters = nfds <= 1 ? &C->waiter : malloc(sizeof(struct co_waiter) * nfds);
+    if (waiters == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+    int n = 0;
+    int ret = 0;
+    for (nfds_t i = 0; i < nfds; i++) {
+        if (fds[i].fd < 0)
+            continue;
+        waiters[n].id = S->running;
+        waiters[n].fd = fds[i].fd;
+        waiters[n].events = fds[i].events & (POLLIN | POLLOUT);
+        if (_fd_add_waiter(S, &waiters[n]) < 0) {
+            ret = -1;
+            break;
+        }
+        n++;
+    }
+    C->waiters = waiters;
+    // 没有等待任何 fd 又不超时的话永远不会被唤醒
+    if (ret == 0 && !(n == 0 && timeout < 0))
+        ret = _wait(S, timeout);
+    for (int i = 0; i < n; i++)
+        _fd_remove_waiter(S, &waiters[i]);
+    C->waiters = NULL;
+    if (waiters != &C->waiter)
+        free(waiters);
+    return ret;
+}
+
+// 等待 fd 事件或者最近的定时器到期，唤醒对应的协程，没有协程在等待时返回 0
+static int
+_reactor_poll(struct co_schedule* S) {
+    if (S->nwaiting == 0)
+        return 0;
+    int epfd = _epoll_fd(S);
+    if (epfd < 0)
+        return 0;
+
+    int timeout = -1;
+    if (S->ntimer > 0) {
+        int64_t left = S->timer[0].deadline - _now_ms();
+        timeout = left < 0 ? 0 : (int)left;
+    }
+    struct epoll_event events[MAX_EVENTS];
+    int n = epoll_wait(epfd, events, MAX_EVENTS, timeout);
+    for (int i = 0; i < n; i++) {
+        int fd = events[i].data.fd;
+        int revents = (int)events[i].events;
+        for (struct co_waiter* p = S->fds[fd].head; p; p = p->next) {
+            int ready = revents & (p->events | POLLERR | POLLHUP);
+            struct coroutine* C = S->co[p->id];
+            if (ready && C->waiting)
+                _wake_waiting(S, C, p->id, ready);
+        }
+    }
+
+    int64_t now = _now_ms();
+    while (S->ntimer > 0 && S->timer[0].deadline <= now) {
+        struct co_timer t = S->timer[0];
+        _timer_pop(S);
+        struct coroutine* C = S->co[t.id];
+        if (C && C->waiting && C->wait_seq == t.seq)
+            _wake_waiting(S, C, t.id, 0);
+    }
+    return 1;
+}
+
+// 等待 fd 就绪，返回就绪的事件，超时返回 0，出错返回 -1
+int
+co_wait_fd(struct co_schedule* S, int fd, short events, int timeout) {
+    assert(S->running >= 0);
+    struct pollfd pfd;
+    pfd.fd = fd;
+    pfd.events = events;
+    pfd.revents = 0;
+    int ret = _wait_fds(S, &pfd, 1, timeout);
+    // 普通文件不能加入 epoll，但它们总是就绪的
+    if (ret < 0 && errno == EPERM)
+        return events;
+    return ret;
+}
+
+// 和 poll 相同，但是只挂起当前协程
+int
+co_poll(struct co_schedule* S, struct pollfd* fds, nfds_t nfds, int timeout) {
+    assert(S->running >= 0);
+    int64_t deadline = timeout > 0 ? _now_ms() + timeout : 0;
+    for (;;) {
+        // 先检查一次，已经就绪或者不等待时直接返回，revents 也由 poll 填写
+        int ret = poll(fds, nfds, 0);
+        if (ret != 0 || timeout == 0)
+            return ret;
+        int left = -1;
+        if (timeout > 0) {
+            int64_t now = _now_ms();
+            if (now >= deadline)
+                return 0;
+            left = (int)(deadline - now);
+        }
+        int revents = _wait_fds(S, fds, nfds, left);
+        if (revents < 0)
+            return -1;
+        // 所有的 fd 都小于 0 并且不超时
+        if (revents == 0 && timeout < 0)
+            return 0;
+    }
+}
+
+// 挂起当前协程 ms 毫秒
+void
+co_sleep(struct co_schedule* S, int ms) {
+    assert(S->running >= 0);
+    _wait(S, ms < 0 ? 0 : ms);
+}
+#endif // ZCO_REACTOR
+
+// 依次运行就绪队列中的协程，队列为空时等待 reactor，直到没有协程可以运行
+int
+co_run(struct co_schedule* S) {
+    assert(S->running == -1);
+    for (;;) {
+        if (S->runq_num == 0) {
+#ifdef ZCO_REACTOR
+            // 没有就绪的协程时等待 fd 事件或者定时器
+            if (_reactor_poll(S))
+                continue;
+#endif
+            break;
+        }
+        int id = S->runq[S->runq_head];
+        S->runq_head = (S->runq_head + 1) % S->runq_cap;
+        S->runq_num -= 1;
+        // 协程在队列中时结束了，它的 id 可能已经被新的协程复用，
+        // 只有 queued 还是 1 时才说明这一项是有效的
+        struct coroutine* C = S->co[id];
+        if (C == NULL || !C->queued)
+            continue;
+        C->queued = 0;
+        co_resume(S, id);
+    }
+    return S->nco;
+}
@@ -1,5 +1,12 @@
 #pragma once
 
+#include <stddef.h>
+#include <poll.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
 enum co_state {
     co_dead = 0,
     co_ready = 1,
@@ -11,12 +18,50 @@ struct co_schedule; // co_schedule
 
 typedef void (*co_func)(struct co_schedule*, void* ud);
 
-struct co_schedule* co_open(void);
+// 创建调度器，nshared 为共享栈的个数，小于 1 时按 1 处理。共享栈越多，
+// 轮流运行的协程越可能各自占着一个栈，切换时就不需要拷贝栈
+struct co_schedule* co_open(int nshared);
 void co_close(struct co_schedule*);
+// 创建一个使用共享栈的协程，轮转分配共享栈，切换时可能需要拷贝栈
 int co_new(struct co_schedule*, co_func, void* ud);
+// 创建一个使用第 hint 个共享栈（对共享栈个数取模）的协程，hint 小于 0 时
+// 和 co_new 相同，轮转分配。经常交替运行的协程应该分配到不同的共享栈
+int co_new_shared(struct co_schedule*, co_func, void* ud, int hint);
+// 创建一个使用独立栈的协程，切换时不拷贝栈，栈上的指针在切换之后依然有效；
+// stack_size 为 0 时和 co_new 相同。独立栈由 mmap 分配，带有保护页，
+// 协程结束后回收到栈池中复用。失败返回 -1
+int co_new_stack(struct co_schedule*, co_func, void* ud, size_t stack_size);
 void co_resume(struct co_schedule*, int id);
 // 返回给定 id 的协程的状态
 int co_status(struct co_schedule*, int id);
 // 返回正在运行的协程的 id
 int co_id(struct co_schedule*);
 void co_yield(struct co_schedule*);
+
+// 就绪队列调度：co_spawn 创建协程并放入就绪队列，co_run 依次恢复队列中的
+// 协程。协程调用 co_yield 之后不会再被运行，直到有人对它调用 co_wake，
+// 想让出 CPU 但继续排队的协程先 co_wake(S, co_id(S)) 再 co_yield。
+// 没有就绪的协程时，挂起的协程不占用任何调度开销
+int co_spawn(struct co_schedule*, co_func, void* ud);
+// 将协程放入就绪队列，已经在队列中时什么都不做
+void co_wake(struct co_schedule*, int id);
+// 运行直到就绪队列为空，返回还没有结束的协程个数，所有协程都结束时为 0
+int co_run(struct co_schedule*);
+
+// 当前线程中正在运行的协程所属的调度器，不在协程中时返回 NULL
+struct co_schedule* co_current(void);
+
+// Linux 上 co_schedule 带有一个 epoll reactor，下面的函数只能在协程中调用，
+// 挂起当前协程，由 co_run 在 fd 就绪或者超时后恢复。timeout 单位为毫秒，
+// 小于 0 时不超时。链接 co_hook.c 后 read/write 等调用会自动使用它们
+//
+// 等待 fd 的 POLLIN 或 POLLOUT 事件，返回就绪的事件，超时返回 0，出错返回 -1
+int co_wait_fd(struct co_schedule*, int fd, short events, int timeout);
+// 和 poll 相同，但是只挂起当前协程
+int co_poll(struct co_schedule*, struct pollfd* fds, nfds_t nfds, int timeout);
+// 挂起当前协程 ms 毫秒
+void co_sleep(struct co_schedule*, int ms);
+
+#ifdef __cplusplus
+}
+#endif